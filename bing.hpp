@@ -2,5 +2,22 @@
 
 #include "speech.hpp"
 #include "qnamaker.hpp"
+#include "questionindex.hpp"
+#include "knowledgebase.hpp"
+#include "presynthesizer.hpp"
 #include "customvision.hpp"
+#include "endpointer.hpp"
+#include "ringbuffer.hpp"
+#include "tokenmanager.hpp"
+#include "keypool.hpp"
+#include "session.hpp"
+#include "retrypolicy.hpp"
+#include "circuitbreaker.hpp"
+#include "concurrencylimiter.hpp"
+#include "requestoptions.hpp"
+#include "result.hpp"
+#include "responsebuffer.hpp"
+#include "router.hpp"
+#include "ratelimiter.hpp"
+#include "standinserver.hpp"
 #include "exception.hpp"
@@ -0,0 +1,160 @@
+#include "circuitbreaker.hpp"
+
+#include <QDateTime>
+
+namespace Bing {
+
+const double DEFAULT_FAILURE_RATE = 0.5;
+const int DEFAULT_MIN_REQUESTS    = 10;
+const int DEFAULT_SLOW_CALL       = 10 * 1000; // Milliseconds
+const int DEFAULT_OPEN_DURATION   = 5 * 1000;  // Milliseconds
+const int MAX_OPEN_DURATION       = 60 * 1000; // Milliseconds
+const int OUTCOME_WINDOW          = 10 * 1000; // Milliseconds covered by the failure rate
+const int HALF_OPEN_PROBES        = 1;         // Concurrent requests let through while half-open
+
+CircuitBreaker::CircuitBreaker() :
+    mState(Closed),
+    mFailureRate(DEFAULT_FAILURE_RATE),
+    mMinRequests(DEFAULT_MIN_REQUESTS),
+    mSlowCall(DEFAULT_SLOW_CALL),
+    mOpenDuration(DEFAULT_OPEN_DURATION),
+    mBackoff(DEFAULT_OPEN_DURATION),
+    mOpenUntil(0),
+    mProbes(0),
+    mGeneration(0)
+{
+}
+
+bool CircuitBreaker::isFailure(guint status)
+{
+    switch (status) {
+    case SOUP_STATUS_CANT_RESOLVE:
+    case SOUP_STATUS_CANT_CONNECT:
+    case SOUP_STATUS_IO_ERROR:
+    case SOUP_STATUS_SSL_FAILED:
+    case SOUP_STATUS_REQUEST_TIMEOUT:
+    case SOUP_STATUS_INTERNAL_SERVER_ERROR:
+    case SOUP_STATUS_BAD_GATEWAY:
+    case SOUP_STATUS_SERVICE_UNAVAILABLE:
+    case SOUP_STATUS_GATEWAY_TIMEOUT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void CircuitBreaker::configure(double failureRate, int minRequests, int slowCall, int openDuration)
+{
+    QMutexLocker locker(&mMutex);
+
+    mFailureRate = failureRate;
+    mMinRequests = minRequests;
+    mSlowCall = slowCall;
+    mOpenDuration = openDuration;
+    mBackoff = openDuration;
+}
+
+CircuitBreaker::State CircuitBreaker::state() const
+{
+    QMutexLocker locker(&mMutex);
+    auto state = mState;
+
+    if (state == Open && QDateTime::currentMSecsSinceEpoch() >= mOpenUntil) {
+        state = HalfOpen;
+    }
+    return state;
+}
+
+bool CircuitBreaker::allow(int *generation)
+{
+    QMutexLocker locker(&mMutex);
+    auto now = QDateTime::currentMSecsSinceEpoch();
+
+    if (mState == Open && now >= mOpenUntil) {
+        mState = HalfOpen;
+        mProbes = 0;
+        mGeneration++;
+    }
+    *generation = mGeneration;
+
+    switch (mState) {
+    case Closed:
+        return true;
+    case HalfOpen:
+        if (mProbes < HALF_OPEN_PROBES) {
+            mProbes++;
+            return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+void CircuitBreaker::record(int generation, bool failed, int msecs)
+{
+    QMutexLocker locker(&mMutex);
+    auto now = QDateTime::currentMSecsSinceEpoch();
+
+    if (generation != mGeneration) {
+        return;
+    }
+    failed = failed || (mSlowCall > 0 && msecs >= mSlowCall);
+
+    if (mState == HalfOpen) {
+        mProbes = qMax(mProbes - 1, 0);
+        if (failed) {
+            mBackoff = qMin(mBackoff * 2, MAX_OPEN_DURATION);
+            open(now);
+        } else {
+            mState = Closed;
+            mBackoff = mOpenDuration;
+            mOutcomes.clear();
+            mGeneration++;
+        }
+        return;
+    }
+
+    if (mState == Closed) {
+        mOutcomes.enqueue({ now, failed });
+        update(now);
+    }
+}
+
+void CircuitBreaker::release(int generation)
+{
+    QMutexLocker locker(&mMutex);
+
+    if (mState == HalfOpen && generation == mGeneration) {
+        mProbes = qMax(mProbes - 1, 0);
+    }
+}
+
+void CircuitBreaker::open(qint64 now)
+{
+    mState = Open;
+    mOpenUntil = now + mBackoff;
+    mProbes = 0;
+    mOutcomes.clear();
+    mGeneration++;
+}
+
+void CircuitBreaker::update(qint64 now)
+{
+    while (!mOutcomes.isEmpty() && mOutcomes.head().time <= now - OUTCOME_WINDOW) {
+        mOutcomes.dequeue();
+    }
+    if (mOutcomes.size() < mMinRequests) {
+        return;
+    }
+
+    auto failures = 0;
+    for (auto &outcome : mOutcomes) {
+        failures += outcome.failed ? 1 : 0;
+    }
+    if (failures >= mFailureRate * mOutcomes.size()) {
+        open(now);
+    }
+}
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <libsoup/soup.h>
+#include <QMutex>
+#include <QQueue>
+
+namespace Bing {
+
+/**
+ * Fails requests to an unhealthy endpoint right away instead of letting
+ * each of them wait for the session timeout.
+ *
+ * The breaker opens once enough of the recent requests failed or were
+ * too slow. After a cooldown it lets a few probe requests through
+ * (half-open) and closes again if they succeed. Every failed probe
+ * doubles the cooldown, up to a limit.
+ */
+class CircuitBreaker {
+public:
+    enum State {
+        Closed = 0,
+        Open,
+        HalfOpen,
+    };
+
+    CircuitBreaker();
+
+    /**
+     * Whether status says the endpoint itself is unhealthy, as opposed to
+     * the request or the quota
+     */
+    static bool isFailure(guint status);
+
+    /**
+     * \param failureRate Share of failed or slow requests that opens the breaker
+     * \param minRequests Requests needed in the window before the rate counts
+     * \param slowCall Milliseconds after which a request counts as failed, 0 to disable
+     * \param openDuration Milliseconds the breaker stays open before probing
+     */
+    void configure(double failureRate, int minRequests, int slowCall, int openDuration);
+
+    State state() const;
+
+    /**
+     * Whether a request may be sent now; every allowed request must be
+     * followed by record() or release() with the generation it was given
+     */
+    bool allow(int *generation);
+
+    /**
+     * Outcome of an allowed request. Outcomes of requests allowed before
+     * the breaker last changed state are ignored, so a request that
+     * started before the breaker opened can't close it again.
+     */
+    void record(int generation, bool failed, int msecs);
+
+    /**
+     * Gives back an allowed request that never reached the endpoint
+     */
+    void release(int generation);
+
+private:
+    struct Outcome {
+        qint64 time;
+        bool   failed;
+    };
+
+    mutable QMutex  mMutex;
+    State           mState;
+    double          mFailureRate;
+    int             mMinRequests;
+    int             mSlowCall;
+    int             mOpenDuration;
+    int             mBackoff;
+    qint64          mOpenUntil;
+    int             mProbes;
+    int             mGeneration; // Bumped on every change of state
+    QQueue<Outcome> mOutcomes;
+
+    void open(qint64 now);
+    void update(qint64 now);
+};
+
+}
@@ -0,0 +1,130 @@
+#include "concurrencylimiter.hpp"
+
+#include <QDateTime>
+
+namespace Bing {
+
+const int DEFAULT_INITIAL_LIMIT = 8;
+const int DEFAULT_MINIMUM_LIMIT = 1;
+const int DEFAULT_MAXIMUM_LIMIT = 64;
+const double DEFAULT_TOLERANCE  = 2.0;
+const double THROTTLE_BACKOFF   = 0.5; // Limit multiplier when the service throttles or times out
+const double LATENCY_BACKOFF    = 0.9; // Limit multiplier when latency climbs
+const int LATENCY_WINDOW        = 250; // Samples after which the lowest latency is measured anew
+const int LATENCY_SLACK         = 10;  // Milliseconds of jitter tolerated on top of the lowest latency
+const guint STATUS_TOO_MANY_REQUESTS = 429;
+
+ConcurrencyLimiter::ConcurrencyLimiter() :
+    mLimit(DEFAULT_INITIAL_LIMIT),
+    mMinimum(DEFAULT_MINIMUM_LIMIT),
+    mMaximum(DEFAULT_MAXIMUM_LIMIT),
+    mTolerance(DEFAULT_TOLERANCE),
+    mInFlight(0),
+    mMinLatency(0),
+    mWindowMinLatency(0),
+    mSamples(0),
+    mLastDecrease(0)
+{
+}
+
+void ConcurrencyLimiter::configure(int initial, int minimum, int maximum, double tolerance)
+{
+    QMutexLocker locker(&mMutex);
+
+    mMinimum = qMax(minimum, 1);
+    mMaximum = qMax(maximum, mMinimum);
+    mLimit = qBound<double>(mMinimum, initial, mMaximum);
+    mTolerance = qMax(tolerance, 1.0);
+    mSlotFreed.wakeAll();
+}
+
+int ConcurrencyLimiter::limit() const
+{
+    QMutexLocker locker(&mMutex);
+    return static_cast<int>(mLimit);
+}
+
+int ConcurrencyLimiter::inFlight() const
+{
+    QMutexLocker locker(&mMutex);
+    return mInFlight;
+}
+
+bool ConcurrencyLimiter::acquire(int msecs)
+{
+    QMutexLocker locker(&mMutex);
+
+    if (mInFlight >= static_cast<int>(mLimit)) {
+        mSlotFreed.wait(&mMutex, static_cast<unsigned long>(qMax(msecs, 0)));
+    }
+    if (mInFlight >= static_cast<int>(mLimit)) {
+        return false;
+    }
+
+    mInFlight++;
+    return true;
+}
+
+void ConcurrencyLimiter::release()
+{
+    QMutexLocker locker(&mMutex);
+
+    mInFlight--;
+    mSlotFreed.wakeOne();
+}
+
+// Several requests in flight usually see the same overload, so the limit
+// is cut at most once per round trip
+void ConcurrencyLimiter::decrease(double factor, qint64 now)
+{
+    if (now - mLastDecrease < qMax(mMinLatency, 1)) {
+        return;
+    }
+
+    mLastDecrease = now;
+    mLimit = qMax(static_cast<double>(mMinimum), mLimit * factor);
+}
+
+void ConcurrencyLimiter::record(guint status, int msecs)
+{
+    QMutexLocker locker(&mMutex);
+    auto now = QDateTime::currentMSecsSinceEpoch();
+    auto saturated = mInFlight >= static_cast<int>(mLimit) / 2;
+
+    mInFlight--;
+    mSlotFreed.wakeOne();
+
+    if (status == STATUS_TOO_MANY_REQUESTS || status == SOUP_STATUS_SERVICE_UNAVAILABLE ||
+        status == SOUP_STATUS_REQUEST_TIMEOUT || status == SOUP_STATUS_GATEWAY_TIMEOUT ||
+        status == SOUP_STATUS_IO_ERROR) {
+        decrease(THROTTLE_BACKOFF, now);
+        return;
+    }
+    if (!SOUP_STATUS_IS_SUCCESSFUL(status)) {
+        return;
+    }
+
+    // The lowest latency is what the endpoint takes without queueing; it's
+    // re-measured every window so the limiter follows route changes
+    if (mWindowMinLatency == 0 || msecs < mWindowMinLatency) {
+        mWindowMinLatency = msecs;
+    }
+    if (mMinLatency == 0 || msecs < mMinLatency) {
+        mMinLatency = msecs;
+    }
+    if (++mSamples >= LATENCY_WINDOW) {
+        mMinLatency = mWindowMinLatency;
+        mWindowMinLatency = 0;
+        mSamples = 0;
+    }
+
+    if (msecs > mMinLatency * mTolerance + LATENCY_SLACK) {
+        decrease(LATENCY_BACKOFF, now);
+    } else if (saturated) {
+        // Only a limit that's actually used is raised
+        mLimit = qMin(static_cast<double>(mMaximum), mLimit + 1 / mLimit);
+        mSlotFreed.wakeOne();
+    }
+}
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <libsoup/soup.h>
+#include <QMutex>
+#include <QWaitCondition>
+
+namespace Bing {
+
+/**
+ * Learns how many requests an endpoint can take at once.
+ *
+ * The limit grows by one per round trip while latency stays close to the
+ * lowest seen recently, shrinks a little when latency climbs, which means
+ * requests are queueing at the service, and halves when the service
+ * throttles or times out. Requests over the limit wait for a slot rather
+ * than piling up at the service.
+ */
+class ConcurrencyLimiter {
+public:
+    ConcurrencyLimiter();
+
+    /**
+     * \param initial Limit before anything has been measured
+     * \param minimum Lowest limit, at least 1
+     * \param maximum Highest limit
+     * \param tolerance Latency, as a multiple of the lowest, above which the limit shrinks
+     */
+    void configure(int initial, int minimum, int maximum, double tolerance);
+
+    int limit() const;
+    int inFlight() const;
+
+    /**
+     * Takes a slot, waiting up to msecs for one; every acquired slot must
+     * be followed by record() or release()
+     */
+    bool acquire(int msecs);
+
+    /**
+     * Outcome of a request that held a slot
+     */
+    void record(guint status, int msecs);
+
+    /**
+     * Gives back a slot whose request never completed, e.g. when cancelled
+     */
+    void release();
+
+private:
+    mutable QMutex mMutex;
+    QWaitCondition mSlotFreed;
+    double         mLimit;
+    int            mMinimum;
+    int            mMaximum;
+    double         mTolerance;
+    int            mInFlight;
+    int            mMinLatency;
+    int            mWindowMinLatency;
+    int            mSamples;
+    qint64         mLastDecrease;
+
+    void decrease(double factor, qint64 now);
+};
+
+}
@@ -1,4 +1,9 @@
 #include "customvision.hpp"
+#include "session.hpp"
+#include "router.hpp"
+#include "ratelimiter.hpp"
+#include "responsebuffer.hpp"
+#include "exception.hpp"
 #include <QBuffer>
 #include <QJsonDocument>
 #include <QJsonObject>
@@ -6,26 +11,14 @@
 
 namespace Bing {
 
+const QString PREDICTION_PATH = "/customvision/v1.0/Prediction/";
+
 CustomVision::CustomVision(int log, QObject *parent) :
     QObject(parent)
 {
-    SoupLogger *logger;
-    SoupLoggerLogLevel logLevel = SOUP_LOGGER_LOG_BODY;
-
-    if (log <= 0) {
-        logLevel = SOUP_LOGGER_LOG_NONE;
-    } else if (log == 1) {
-        logLevel = SOUP_LOGGER_LOG_MINIMAL;
-    } else if (log == 2) {
-        logLevel = SOUP_LOGGER_LOG_HEADERS;
-    } else {
-        logLevel = SOUP_LOGGER_LOG_BODY;
-    }
-
-    mSession = soup_session_new_with_options(SOUP_SESSION_ADD_FEATURE_BY_TYPE, SOUP_TYPE_CONTENT_SNIFFER, NULL);
-    logger = soup_logger_new(logLevel, -1);
-    soup_session_add_feature(mSession, SOUP_SESSION_FEATURE(logger));
-    g_object_unref(logger);
+    Session::instance()->enableLogging(log);
+    mSession = Session::instance()->soup();
+    g_object_ref(mSession);
 }
 
 CustomVision::~CustomVision()
@@ -38,18 +31,35 @@ CustomVision::~CustomVision()
 
 void CustomVision::setSubscriptionKey(const QString &subscriptionKey, bool isTrainingKey)
 {
-    mSubscriptionKey = subscriptionKey;
+    setSubscriptionKeys(QStringList() << subscriptionKey, isTrainingKey);
+}
+
+void CustomVision::setSubscriptionKeys(const QStringList &subscriptionKeys, bool isTrainingKey, KeyPool::Strategy strategy, int requestsPerMinute)
+{
+    mSubscriptionKeys.setKeys(subscriptionKeys);
+    mSubscriptionKeys.setStrategy(strategy);
+    mSubscriptionKeys.setQuota(requestsPerMinute);
     mIsTraining = isTrainingKey;
 }
 
-QList<Prediction> CustomVision::predict(const QImage &image, const QString &projectId, const QString &iterationId)
+void CustomVision::prewarm(int connections, bool wait)
 {
+    Session::instance()->prewarm(Router::instance()->endpoints(Router::PredictionService), connections, wait);
+}
+
+QList<Prediction> CustomVision::predict(const QImage &image, const QString &projectId, const QString &iterationId, const RequestOptions &options)
+{
+    return tryPredict(image, projectId, iterationId, options).get();
+}
+
+Result<QList<Prediction> > CustomVision::tryPredict(const QImage &image, const QString &projectId, const QString &iterationId, const RequestOptions &options)
+{
+    Result<QList<Prediction> > result;
+    QElapsedTimer timer;
     SoupMessage *msg;
-    SoupMessageBody *body;
     QByteArray imageData;
     QBuffer imageBuffer(&imageData);
-    QString url = "https://southcentralus.api.cognitive.microsoft.com/customvision/v1.0/Prediction/" + projectId + "/image";
-    QList<Prediction> predictions;
+    QString url = Router::instance()->select(Router::PredictionService) + PREDICTION_PATH + projectId + "/image";
 
     imageBuffer.open(QIODevice::WriteOnly);
     image.save(&imageBuffer, "JPEG");
@@ -61,14 +71,27 @@ QList<Prediction> CustomVision::predict(const QImage &image, const QString &proj
     // Send the request
     msg = soup_message_new("POST", url.toUtf8().data());
     soup_message_set_request(msg, "application/octet-stream", SOUP_MEMORY_COPY, imageData.data(), imageData.size());
-    if (!mIsTraining) {
-        soup_message_headers_append(msg->request_headers, "Prediction-Key", mSubscriptionKey.toUtf8().data());
+    QString subscriptionKey;
+    auto prepare = [&](SoupMessage *msg, int attempt) {
+        if (attempt > 0) {
+            mSubscriptionKeys.report(subscriptionKey, msg);
+        }
+        subscriptionKey = mSubscriptionKeys.acquire();
+        RateLimiter::instance()->acquire(Router::PredictionService, subscriptionKey, options);
+        if (!mIsTraining) {
+            soup_message_headers_replace(msg->request_headers, "Prediction-Key", subscriptionKey.toUtf8().data());
+        }
+    };
+    timer.start();
+    auto httpStatusCode = Session::instance()->send(msg, Router::instance()->route(Router::PredictionService, prepare), true, options);
+    mSubscriptionKeys.report(subscriptionKey, msg);
+    result.setResponse(msg, httpStatusCode, timer);
+    if (!result.ok()) {
+        g_object_unref(msg);
+        return result;
     }
-    soup_session_send_message(mSession, msg);
-    g_object_get(msg, "response-body", &body, NULL);
-
-    QByteArray responseJson(body->data, body->length);
-    auto responseObj = QJsonDocument::fromJson(responseJson).object();
+    auto body = ResponseBuffer::take(msg);
+    auto responseObj = QJsonDocument::fromJson(body.bytes()).object();
     auto predictionsArray = responseObj["Predictions"].toArray();
     for (auto i = 0; i < predictionsArray.size(); i++) {
         auto predictionObj = predictionsArray[i].toObject();
@@ -76,10 +99,10 @@ QList<Prediction> CustomVision::predict(const QImage &image, const QString &proj
         prediction.tag = predictionObj["Tag"].toString();
         prediction.tagId = predictionObj["TagId"].toString();
         prediction.probability = predictionObj["Probability"].toDouble();
-        predictions.push_back(prediction);
+        result.value.push_back(prediction);
     }
 
-    return predictions;
+    return result;
 }
 
 }
\ No newline at end of file
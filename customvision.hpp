@@ -3,6 +3,9 @@
 #include <libsoup/soup.h>
 #include <QObject>
 #include <QImage>
+#include "keypool.hpp"
+#include "requestoptions.hpp"
+#include "result.hpp"
 
 namespace Bing {
 
@@ -19,11 +22,18 @@ public:
     ~CustomVision();
 
     void setSubscriptionKey(const QString &subscriptionKey, bool isTrainingKey = false);
-    QList<Prediction> predict(const QImage &image, const QString &projectId, const QString &iterationId = QString());
+    void setSubscriptionKeys(const QStringList &subscriptionKeys, bool isTrainingKey = false, KeyPool::Strategy strategy = KeyPool::LeastRecentlyUsed, int requestsPerMinute = 0);
+    void prewarm(int connections = 1, bool wait = false);
+    QList<Prediction> predict(const QImage &image, const QString &projectId, const QString &iterationId = QString(), const RequestOptions &options = RequestOptions());
+
+    /**
+     * Same as predict(), but failures are returned instead of thrown
+     */
+    Result<QList<Prediction> > tryPredict(const QImage &image, const QString &projectId, const QString &iterationId = QString(), const RequestOptions &options = RequestOptions());
 
 private:
     SoupSession * mSession;
-    QString       mSubscriptionKey;
+    KeyPool       mSubscriptionKeys;
     bool          mIsTraining;
 };
 
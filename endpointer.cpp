@@ -0,0 +1,203 @@
+#include "endpointer.hpp"
+
+#include <QFutureWatcher>
+#include <QtConcurrent>
+
+namespace Bing {
+
+const int DEFAULT_PAUSE_TIMEOUT       = 200;  // Milliseconds of silence before speculating
+const int DEFAULT_END_OF_TURN_TIMEOUT = 800;  // Milliseconds of silence ending the turn
+const int DEFAULT_SILENCE_THRESHOLD   = 500;  // Mean amplitude below which a frame is silent
+const int BYTES_PER_MSEC              = 32;   // 16-bit mono at 16000hz
+
+static int meanAmplitude(const QByteArray &pcm)
+{
+    auto samples = reinterpret_cast<const qint16 *>(pcm.constData());
+    auto count = pcm.size() / 2;
+    qint64 sum = 0;
+
+    if (count <= 0) {
+        return 0;
+    }
+
+    for (auto i = 0; i < count; i++) {
+        int sample = samples[i];
+        sum += sample < 0 ? -sample : sample;
+    }
+
+    return sum / count;
+}
+
+Endpointer::Endpointer(Speech *speech, QObject *parent) :
+    QObject(parent),
+    mSpeech(speech),
+    mLanguage(Speech::EnglishUnitedStates),
+    mMode(Speech::Interactive),
+    mSpeculative(true),
+    mPauseTimeout(DEFAULT_PAUSE_TIMEOUT),
+    mEndOfTurnTimeout(DEFAULT_END_OF_TURN_TIMEOUT),
+    mSilenceThreshold(DEFAULT_SILENCE_THRESHOLD),
+    mSpeaking(false),
+    mSilence(0),
+    mGeneration(0),
+    mSpeculation(0),
+    mSpeculationDone(false),
+    mStats()
+{
+}
+
+void Endpointer::setLanguage(Speech::RecognitionLanguage language)
+{
+    mLanguage = language;
+}
+
+void Endpointer::setMode(Speech::RecognitionMode mode)
+{
+    mMode = mode;
+}
+
+void Endpointer::setSpeculative(bool speculative)
+{
+    mSpeculative = speculative;
+}
+
+void Endpointer::setPauseTimeout(int msecs)
+{
+    mPauseTimeout = msecs;
+}
+
+void Endpointer::setEndOfTurnTimeout(int msecs)
+{
+    mEndOfTurnTimeout = msecs;
+}
+
+void Endpointer::setSilenceThreshold(int amplitude)
+{
+    mSilenceThreshold = amplitude;
+}
+
+void Endpointer::feed(const QByteArray &pcm)
+{
+    bool voiced = meanAmplitude(pcm) >= mSilenceThreshold;
+
+    // Keep only the latest frame of leading silence as pre-roll
+    if (!voiced && !mSpeaking) {
+        mAudio = pcm;
+        return;
+    }
+
+    mAudio.append(pcm);
+    if (voiced) {
+        mSpeaking = true;
+        mSilence = 0;
+
+        // The speaker resumed, so the speculative request is stale
+        if (mSpeculation) {
+            mRequests.value(mSpeculation).cancel();
+            mSpeculation = 0;
+            mSpeculationDone = false;
+            mStats.restarts++;
+        }
+        return;
+    }
+
+    mSilence += pcm.size() / BYTES_PER_MSEC;
+    if (mSilence >= mEndOfTurnTimeout) {
+        endTurn();
+    } else if (mSpeculative && !mSpeculation && mSilence >= mPauseTimeout) {
+        mSpeculation = startRequest();
+        mStats.speculations++;
+    }
+}
+
+void Endpointer::reset()
+{
+    mAudio.clear();
+    mSpeaking = false;
+    mSilence = 0;
+    mSpeculation = 0;
+    mSpeculationDone = false;
+    mDelivering.clear();
+    for (auto &token : mRequests) {
+        token.cancel();
+    }
+}
+
+Endpointer::Stats Endpointer::stats() const
+{
+    return mStats;
+}
+
+int Endpointer::startRequest()
+{
+    auto speech = mSpeech;
+    auto audio = mAudio;
+    auto language = mLanguage;
+    auto mode = mMode;
+    auto generation = ++mGeneration;
+    auto watcher = new QFutureWatcher<Outcome>(this);
+    RequestOptions options;
+
+    mRequests.insert(generation, options.token);
+
+    connect(watcher, &QFutureWatcher<Outcome>::finished, this, [this, watcher, generation]() {
+        finishRequest(generation, watcher->result());
+        watcher->deleteLater();
+    });
+    watcher->setFuture(QtConcurrent::run([speech, audio, language, mode, options]() -> Outcome {
+        Outcome outcome;
+
+        // Speculative requests are cancelled all the time, so failures aren't thrown
+        auto result = speech->tryRecognize(audio, language, mode, options);
+        outcome.response = result.value;
+        outcome.error = result.error;
+        return outcome;
+    }));
+
+    return generation;
+}
+
+void Endpointer::finishRequest(int generation, const Outcome &outcome)
+{
+    mRequests.remove(generation);
+    if (mDelivering.remove(generation)) {
+        deliver(outcome);
+    } else if (generation == mSpeculation) {
+        mSpeculationDone = true;
+        mSpeculationOutcome = outcome;
+    }
+}
+
+void Endpointer::endTurn()
+{
+    if (mSpeculation) {
+        mStats.wins++;
+        if (mSpeculationDone) {
+            deliver(mSpeculationOutcome);
+        } else {
+            mDelivering.insert(mSpeculation);
+        }
+    } else {
+        if (mSpeculative) {
+            mStats.misses++;
+        }
+        mDelivering.insert(startRequest());
+    }
+
+    mAudio.clear();
+    mSpeaking = false;
+    mSilence = 0;
+    mSpeculation = 0;
+    mSpeculationDone = false;
+}
+
+void Endpointer::deliver(const Outcome &outcome)
+{
+    if (outcome.error) {
+        emit failed(outcome.error);
+    } else {
+        emit recognized(outcome.response);
+    }
+}
+
+}
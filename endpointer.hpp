@@ -0,0 +1,69 @@
+#pragma once
+
+#include "speech.hpp"
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QSet>
+
+namespace Bing {
+
+class Endpointer : public QObject {
+    Q_OBJECT
+public:
+    struct Stats {
+        int speculations; // Requests started at a short pause
+        int wins;         // Turns answered by a speculative request
+        int restarts;     // Speculations dropped because the speaker resumed
+        int misses;       // Turns that needed a fresh request at end of turn
+    };
+
+    Endpointer(Speech *speech, QObject *parent = nullptr);
+
+    void setLanguage(Speech::RecognitionLanguage language);
+    void setMode(Speech::RecognitionMode mode);
+    void setSpeculative(bool speculative);
+    void setPauseTimeout(int msecs);
+    void setEndOfTurnTimeout(int msecs);
+    void setSilenceThreshold(int amplitude);
+
+    void feed(const QByteArray &pcm);
+    void reset();
+    Stats stats() const;
+
+signals:
+    void recognized(const Bing::Speech::RecognitionResponse &response);
+    void failed(int errorCode);
+
+private:
+    struct Outcome {
+        Speech::RecognitionResponse response;
+        int error;
+    };
+
+    Speech *                    mSpeech;
+    Speech::RecognitionLanguage mLanguage;
+    Speech::RecognitionMode     mMode;
+    bool                        mSpeculative;
+    int                         mPauseTimeout;
+    int                         mEndOfTurnTimeout;
+    int                         mSilenceThreshold;
+
+    QByteArray mAudio;
+    bool       mSpeaking;
+    int        mSilence;
+    int        mGeneration;
+    int        mSpeculation;
+    bool       mSpeculationDone;
+    Outcome    mSpeculationOutcome;
+    QSet<int>  mDelivering;
+    QHash<int, CancellationToken> mRequests;
+    Stats      mStats;
+
+    int startRequest();
+    void finishRequest(int generation, const Outcome &outcome);
+    void endTurn();
+    void deliver(const Outcome &outcome);
+};
+
+}
@@ -0,0 +1,134 @@
+#include "bing.hpp"
+#include <QElapsedTimer>
+#include <QVector>
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+struct Faq {
+    const char *question;
+    const char *paraphrases[4];
+};
+
+// Questions a help desk bot gets, each with ways people actually ask them
+static const Faq FAQS[] = {
+    { "How do I reset my password?", { "password reset how", "how can i reset my password", "reset password", "I forgot my password, how do I reset it" } },
+    { "How do I change my email address?", { "change email address", "how can I update my email address", "how to change my e-mail address", "change the email on my account" } },
+    { "What are your opening hours?", { "opening hours", "when are you open", "what are the opening hours", "your opening hours?" } },
+    { "How do I cancel my subscription?", { "cancel subscription", "how can i cancel my subscription", "I want to cancel my subscription", "subscription cancel how" } },
+    { "Where can I download my invoice?", { "download invoice", "where do I download my invoices", "how to download an invoice", "invoice download where" } },
+    { "Do you ship internationally?", { "international shipping", "do you ship to other countries internationally", "do you ship internationaly", "can you ship internationally" } },
+    { "How long does delivery take?", { "delivery time", "how long does the delivery take", "how long will delivery take", "delivery how long" } },
+    { "How do I return an item?", { "return an item", "how can I return items", "item return how", "I want to return an item" } },
+    { "Can I pay with PayPal?", { "paypal payment", "do you accept paypal", "pay with paypal", "can i pay using paypal" } },
+    { "How do I contact customer support?", { "contact support", "how to contact customer support", "customer support contact", "how can i reach customer support" } },
+    { "Is my personal data secure?", { "is my data secure", "personal data security", "how secure is my personal data", "is personal data safe and secure" } },
+    { "How do I delete my account?", { "delete account", "how can I delete my account", "remove my account", "account deletion how do I" } },
+    { "What payment methods do you accept?", { "accepted payment methods", "which payment methods are accepted", "payment methods", "what methods of payment do you accept" } },
+    { "How do I track my order?", { "track order", "where can I track my order", "order tracking", "how to track my orders" } },
+    { "Can I change my delivery address?", { "change delivery address", "how do I change the delivery address", "update my delivery address", "delivery address change" } },
+    { "Do you offer gift cards?", { "gift cards", "can I buy a gift card", "do you sell gift cards", "gift card offer" } },
+};
+
+static const char *UNRELATED[] = {
+    "What is the weather like today?",
+    "Who won the football game?",
+    "Tell me a joke",
+    "How tall is the Eiffel tower?",
+    "Play some music",
+    "What time is it in Tokyo?",
+    "How do I cook pasta?",
+    "Translate hello to French",
+};
+
+// Worded like a question of the corpus, but asking something it doesn't answer
+static const char *NEAR_MISSES[] = {
+    "How do I reset my PIN?",
+    "How do I reset my router?",
+    "How do I change my phone number?",
+    "How do I change my username?",
+    "How do I cancel my order?",
+    "Where can I download my receipt?",
+    "Where can I download the app?",
+    "How long does a refund take?",
+    "How do I return a gift card?",
+    "Can I pay with Bitcoin?",
+    "How do I contact the sales team?",
+    "How do I delete my order?",
+    "How do I track my refund?",
+    "Can I change my payment method?",
+    "Do you offer student discounts?",
+    "Do you ship on weekends?",
+    "What are your delivery charges?",
+    "Is my payment secure?",
+};
+
+// Measures hit rate, wrong answers, near misses matched and lookup latency
+// of the fuzzy question index over a help desk corpus, at several
+// similarity thresholds
+int main()
+{
+    Bing::QuestionIndex index;
+    auto faqCount = static_cast<int>(sizeof(FAQS) / sizeof(FAQS[0]));
+    auto unrelatedCount = static_cast<int>(sizeof(UNRELATED) / sizeof(UNRELATED[0]));
+    auto nearMissCount = static_cast<int>(sizeof(NEAR_MISSES) / sizeof(NEAR_MISSES[0]));
+
+    for (auto i = 0; i < faqCount; i++) {
+        index.insert("kb", FAQS[i].question, QByteArray::number(i));
+    }
+
+    for (auto threshold : { 0.4, 0.5, 0.55, 0.6, 0.65, 0.7, 0.8 }) {
+        int hits = 0, wrong = 0, nearMisses = 0, falseHits = 0, queries = 0;
+        QVector<qint64> nsecs;
+        QElapsedTimer timer;
+
+        for (auto i = 0; i < faqCount; i++) {
+            for (auto paraphrase : FAQS[i].paraphrases) {
+                QByteArray value;
+                timer.start();
+                auto found = index.find("kb", paraphrase, threshold, &value);
+                nsecs.append(timer.nsecsElapsed());
+                queries++;
+                if (found && value.toInt() == i) {
+                    hits++;
+                } else if (found) {
+                    wrong++;
+                }
+            }
+        }
+        for (auto i = 0; i < nearMissCount; i++) {
+            QByteArray value;
+            timer.start();
+            auto found = index.find("kb", NEAR_MISSES[i], threshold, &value);
+            nsecs.append(timer.nsecsElapsed());
+            if (found) {
+                nearMisses++;
+            }
+        }
+        for (auto i = 0; i < unrelatedCount; i++) {
+            QByteArray value;
+            timer.start();
+            auto found = index.find("kb", UNRELATED[i], threshold, &value);
+            nsecs.append(timer.nsecsElapsed());
+            if (found) {
+                falseHits++;
+            }
+        }
+
+        std::sort(nsecs.begin(), nsecs.end());
+        qint64 total = 0;
+        for (auto n : nsecs) {
+            total += n;
+        }
+        cout << "threshold " << threshold
+             << "  hit rate: " << 100 * hits / queries << "%"
+             << "  wrong answers: " << wrong
+             << "  near misses matched: " << nearMisses << "/" << nearMissCount
+             << "  unrelated matched: " << falseHits << "/" << unrelatedCount
+             << "  lookup: " << total / nsecs.size() / 1000.0 << " us mean, "
+             << nsecs[nsecs.size() * 99 / 100] / 1000.0 << " us p99" << endl;
+    }
+
+    return 0;
+}
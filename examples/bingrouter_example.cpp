@@ -0,0 +1,61 @@
+#include "bing.hpp"
+#include <QCoreApplication>
+#include <iostream>
+
+using namespace std;
+
+static void printStats()
+{
+    for (auto &endpoint : Bing::Router::instance()->stats(Bing::Router::QnaMakerService)) {
+        cout << endpoint.baseUrl.toStdString()
+             << "  requests: " << endpoint.requests
+             << "  latency: " << endpoint.latency << " ms"
+             << "  errors: " << endpoint.errorRate * 100 << "%"
+             << "  circuit: " << Bing::Session::instance()->circuitState(endpoint.baseUrl) << endl;
+    }
+}
+
+static void ask(Bing::QnaMaker &qnaMaker, int count)
+{
+    for (auto i = 0; i < count; i++) {
+        auto result = qnaMaker.tryGenerateAnswer("How fast is the closest region?");
+        if (!result.ok()) {
+            cout << "Request failed: " << result.status << " " << result.reason.toStdString()
+                 << " after " << result.attempts << " attempts in " << result.elapsed << " ms" << endl;
+        }
+    }
+}
+
+// Routes QnA requests across three local stand-in "regions", then takes the fastest one down
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    Bing::StandInServer regions[3];
+    int latencies[] = { 20, 60, 150 };
+    QStringList baseUrls;
+
+    for (auto i = 0; i < 3; i++) {
+        regions[i].setLatency(latencies[i]);
+        if (regions[i].listen() < 0) {
+            cout << "Can't start stand-in server" << endl;
+            return 1;
+        }
+        baseUrls << regions[i].baseUrl();
+    }
+
+    Bing::Router::instance()->setEndpoints(Bing::Router::QnaMakerService, baseUrls);
+    Bing::QnaMaker qnaMaker;
+    qnaMaker.setSubscriptionKey("stand-in");
+    qnaMaker.setKnowledgeBaseId("stand-in");
+
+    ask(qnaMaker, 100);
+    cout << "All regions up:" << endl;
+    printStats();
+
+    regions[0].setFailureRate(1);
+    ask(qnaMaker, 100);
+    cout << "Fastest region down:" << endl;
+    printStats();
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "bing.hpp"
+#include <QCoreApplication>
+#include <QImage>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+const int THREADS = 8;
+const int SAMPLES = 10;
+const int ANSWER_SIZE = 64 * 1024; // Large answers make a leaked body stand out
+
+// Resident set size in kilobytes
+static long residentKb()
+{
+    long pages = 0, resident = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+
+    if (file) {
+        if (fscanf(file, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(file);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Sends QnA and prediction requests to a local stand-in server under sustained
+// load, sampling memory along the way; after warm-up it should stay flat
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    Bing::StandInServer server;
+    int total = argc > 1 ? atoi(argv[1]) : 100000;
+
+    if (server.listen() < 0) {
+        cout << "Can't start stand-in server" << endl;
+        return 1;
+    }
+
+    QByteArray answer = "{\"answers\":[{\"answer\":\"" + QByteArray(ANSWER_SIZE, 'a') + "\",\"score\":90}]}";
+    server.setResponse("/qnamaker/", "application/json", answer);
+    Bing::Router::instance()->setEndpoints(Bing::Router::QnaMakerService, QStringList() << server.baseUrl());
+    Bing::Router::instance()->setEndpoints(Bing::Router::PredictionService, QStringList() << server.baseUrl());
+
+    Bing::QnaMaker qnaMaker;
+    qnaMaker.setSubscriptionKey("stand-in");
+    qnaMaker.setKnowledgeBaseId("stand-in");
+    Bing::CustomVision customVision;
+    customVision.setSubscriptionKey("stand-in");
+    QImage image(64, 64, QImage::Format_RGB32);
+    image.fill(Qt::white);
+
+    QThreadPool pool;
+    std::atomic<int> next(0), failures(0);
+    pool.setMaxThreadCount(THREADS);
+    for (auto t = 0; t < THREADS; t++) {
+        QtConcurrent::run(&pool, [&]() {
+            int i;
+            while ((i = next++) < total) {
+                bool ok = i % 2 ? qnaMaker.tryGenerateAnswer("How much memory?").ok()
+                                : customVision.tryPredict(image, "stand-in").ok();
+                if (!ok) {
+                    failures++;
+                }
+            }
+        });
+    }
+
+    long baseline = 0;
+    for (auto sample = 1; sample <= SAMPLES; sample++) {
+        while (next < total * sample / SAMPLES && pool.activeThreadCount() > 0) {
+            usleep(10 * 1000);
+        }
+
+        // The first sample is taken once connections and caches are warm
+        auto kb = residentKb();
+        if (sample == 1) {
+            baseline = kb;
+        }
+        cout << "requests: " << qMin(next.load(), total) << "  rss: " << kb << " kB"
+             << "  growth: " << kb - baseline << " kB" << endl;
+    }
+    pool.waitForDone();
+
+    cout << "failures: " << failures << endl;
+    return 0;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <exception>
+#include <libsoup/soup.h>
 
 using namespace std;
 
@@ -9,6 +10,17 @@ namespace Bing {
 enum Error {
     HTTPError = 1,
     IOError = 2,
+    UnavailableError = 3,
+    TimeoutError = 4,
+    CancelledError = 5,
+};
+
+/**
+ * Statuses set by the library itself, in libsoup's range for transport errors
+ */
+enum Status {
+    CircuitOpenStatus = 90,
+    DeadlineExceededStatus = 91,
 };
 
 class Exception : public exception {
@@ -17,20 +29,51 @@ public:
      * Constructor
      *
      * \param errorCode Code number of the error
+     * \param status HTTP or transport status of the failed request, if any
      */
-    Exception(Error errorCode)
+    Exception(Error errorCode, unsigned int status = 0)
     {
         mErrorCode = errorCode;
+        mStatus = status;
+    }
+
+    /**
+     * Error a request that completed with status failed with, 0 if it succeeded
+     */
+    static int errorOf(unsigned int status)
+    {
+        switch (status) {
+        case CircuitOpenStatus: return UnavailableError;
+        case DeadlineExceededStatus: return TimeoutError;
+        case SOUP_STATUS_CANCELLED: return CancelledError;
+        default:
+            if (SOUP_STATUS_IS_SUCCESSFUL(status)) {
+                return 0;
+            }
+            return status < 100 ? IOError : HTTPError;
+        }
+    }
+
+    /**
+     * Exception for a request that failed with an HTTP or transport status
+     */
+    static Exception fromStatus(unsigned int status)
+    {
+        auto error = errorOf(status);
+        return Exception(static_cast<Error>(error ? error : HTTPError), status);
     }
 
     /**
      * Description of the error
      */
-    const char *what()
+    const char *what() const noexcept override
     {
         switch (mErrorCode) {
         case HTTPError: return "HTTP error";
         case IOError: return "IO error";
+        case UnavailableError: return "service unavailable";
+        case TimeoutError: return "deadline exceeded";
+        case CancelledError: return "cancelled";
         default: return "unknown error";
         }
     }
@@ -43,10 +86,19 @@ public:
         return mErrorCode;
     }
 
+    /**
+     * HTTP or transport status of the failed request, 0 if unknown
+     */
+    unsigned int status() const
+    {
+        return mStatus;
+    }
+
 private:
     Exception();
 
-    int mErrorCode;
+    int          mErrorCode;
+    unsigned int mStatus;
 };
 
 }
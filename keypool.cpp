@@ -0,0 +1,144 @@
+#include "keypool.hpp"
+#include "retrypolicy.hpp"
+
+#include <QDateTime>
+
+namespace Bing {
+
+const int QUOTA_WINDOW     = 60 * 1000; // Milliseconds covered by a quota
+const int DEFAULT_COOLDOWN = 30 * 1000; // Milliseconds a throttled key is sidelined without Retry-After
+const guint STATUS_TOO_MANY_REQUESTS = 429;
+
+KeyPool::KeyPool(Strategy strategy) :
+    mStrategy(strategy),
+    mQuota(0)
+{
+}
+
+void KeyPool::setKeys(const QStringList &keys)
+{
+    QMutexLocker locker(&mMutex);
+
+    mKeys.clear();
+    for (auto i = 0; i < keys.size(); i++) {
+        // A key listed twice would be handed out twice as often
+        if (keys.indexOf(keys[i]) != i) {
+            continue;
+        }
+
+        Key key;
+        key.value = keys[i];
+        key.lastUsed = 0;
+        key.sidelinedUntil = 0;
+        mKeys.append(key);
+    }
+}
+
+QStringList KeyPool::keys() const
+{
+    QMutexLocker locker(&mMutex);
+    QStringList keys;
+
+    for (auto &key : mKeys) {
+        keys.append(key.value);
+    }
+    return keys;
+}
+
+bool KeyPool::isEmpty() const
+{
+    QMutexLocker locker(&mMutex);
+    return mKeys.isEmpty();
+}
+
+void KeyPool::setStrategy(Strategy strategy)
+{
+    QMutexLocker locker(&mMutex);
+    mStrategy = strategy;
+}
+
+void KeyPool::setQuota(int requestsPerMinute)
+{
+    QMutexLocker locker(&mMutex);
+    mQuota = requestsPerMinute;
+}
+
+QString KeyPool::acquire()
+{
+    QMutexLocker locker(&mMutex);
+    auto now = QDateTime::currentMSecsSinceEpoch();
+    int best = -1;
+
+    for (auto i = 0; i < mKeys.size(); i++) {
+        auto &key = mKeys[i];
+        if (key.sidelinedUntil > now) {
+            continue;
+        }
+        if (best < 0) {
+            best = i;
+            continue;
+        }
+
+        auto &current = mKeys[best];
+        if (mStrategy == MostRemainingQuota && mQuota > 0) {
+            auto left = remaining(key, now);
+            auto currentLeft = remaining(current, now);
+            if (left > currentLeft || (left == currentLeft && key.lastUsed < current.lastUsed)) {
+                best = i;
+            }
+        } else if (key.lastUsed < current.lastUsed) {
+            best = i;
+        }
+    }
+
+    // Every key is throttled, so use the one that comes back first
+    if (best < 0) {
+        for (auto i = 0; i < mKeys.size(); i++) {
+            if (best < 0 || mKeys[i].sidelinedUntil < mKeys[best].sidelinedUntil) {
+                best = i;
+            }
+        }
+    }
+
+    if (best < 0) {
+        return QString();
+    }
+
+    auto &key = mKeys[best];
+    key.lastUsed = now;
+    if (mQuota > 0) {
+        remaining(key, now);
+        key.uses.enqueue(now);
+    }
+    return key.value;
+}
+
+void KeyPool::report(const QString &key, SoupMessage *msg)
+{
+    if (msg->status_code != STATUS_TOO_MANY_REQUESTS && msg->status_code != SOUP_STATUS_FORBIDDEN) {
+        return;
+    }
+
+    auto now = QDateTime::currentMSecsSinceEpoch();
+    auto cooldown = RetryPolicy::retryAfter(msg);
+    if (cooldown < 0) {
+        cooldown = DEFAULT_COOLDOWN;
+    }
+
+    QMutexLocker locker(&mMutex);
+    for (auto &k : mKeys) {
+        if (k.value == key) {
+            k.sidelinedUntil = now + qMax(cooldown, static_cast<qint64>(0));
+        }
+    }
+}
+
+int KeyPool::remaining(Key &key, qint64 now) const
+{
+    while (!key.uses.isEmpty() && key.uses.head() <= now - QUOTA_WINDOW) {
+        key.uses.dequeue();
+    }
+    return mQuota - key.uses.size();
+}
+
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <libsoup/soup.h>
+#include <QList>
+#include <QMutex>
+#include <QQueue>
+#include <QStringList>
+
+namespace Bing {
+
+/**
+ * Spreads requests for one service across several subscription keys.
+ *
+ * Keys answered with 429 or 403 are sidelined until the service's
+ * Retry-After, or a default cooldown, has passed.
+ */
+class KeyPool {
+public:
+    enum Strategy {
+        LeastRecentlyUsed = 0,
+        MostRemainingQuota,
+    };
+
+    KeyPool(Strategy strategy = LeastRecentlyUsed);
+
+    void setKeys(const QStringList &keys);
+    QStringList keys() const;
+    bool isEmpty() const;
+
+    void setStrategy(Strategy strategy);
+
+    /**
+     * Per-key quota in requests per minute, 0 if unknown
+     */
+    void setQuota(int requestsPerMinute);
+
+    /**
+     * Key to use for the next request
+     */
+    QString acquire();
+
+    /**
+     * Records the outcome of a request made with key
+     */
+    void report(const QString &key, SoupMessage *msg);
+
+private:
+    struct Key {
+        QString        value;
+        qint64         lastUsed;
+        qint64         sidelinedUntil;
+        QQueue<qint64> uses;
+    };
+
+    mutable QMutex mMutex;
+    QList<Key>     mKeys;
+    Strategy       mStrategy;
+    int            mQuota;
+
+    int remaining(Key &key, qint64 now) const;
+};
+
+}
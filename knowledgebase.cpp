@@ -0,0 +1,370 @@
+#include "knowledgebase.hpp"
+
+#include <QFileInfo>
+#include <QDir>
+#include <QHash>
+#include <QMap>
+#include <QSaveFile>
+#include <QSet>
+#include <QVector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace Bing {
+
+const char SNAPSHOT_MAGIC[8] = { 'B', 'I', 'N', 'G', 'K', 'B', '0', '1' };
+const double BM25_K1 = 1.2;
+const double BM25_B  = 0.75;
+
+// Snapshot layout: header, documents, terms sorted by hash, postings, then
+// the UTF-8 strings. Every record is a multiple of 8 bytes, so each
+// section stays aligned within the mapping.
+struct KnowledgeBase::Header {
+    char    magic[8];
+    quint32 documentCount;
+    quint32 termCount;
+    quint32 postingCount;
+    quint32 stringsSize;
+    double  averageLength;
+};
+
+struct KnowledgeBase::Document {
+    quint32 question;
+    quint32 questionLength;
+    quint32 answer;
+    quint32 answerLength;
+    quint32 length;    // Tokens in the question
+    float   selfScore; // Score of the question against itself
+};
+
+struct KnowledgeBase::Term {
+    quint64 hash;
+    quint32 postings;
+    quint32 count;
+    double  idf;
+};
+
+struct KnowledgeBase::Posting {
+    quint32 document;
+    quint32 frequency;
+};
+
+static quint64 termHash(const QString &term)
+{
+    quint64 hash = 14695981039346656037ULL;
+
+    for (auto c : term.toUtf8()) {
+        hash = (hash ^ static_cast<uchar>(c)) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static double termScore(double idf, double frequency, double length, double averageLength)
+{
+    return idf * frequency * (BM25_K1 + 1) / (frequency + BM25_K1 * (1 - BM25_B + BM25_B * length / averageLength));
+}
+
+KnowledgeBase::KnowledgeBase() :
+    mData(nullptr),
+    mSize(0),
+    mHeader(nullptr),
+    mDocuments(nullptr),
+    mTerms(nullptr),
+    mPostings(nullptr),
+    mStrings(nullptr)
+{
+}
+
+KnowledgeBase::~KnowledgeBase()
+{
+    close();
+}
+
+QStringList KnowledgeBase::tokenize(const QString &text)
+{
+    QString normalized;
+
+    for (auto c : text.toCaseFolded()) {
+        normalized.append(c.isLetterOrNumber() ? c : QChar(' '));
+    }
+    return normalized.split(' ', QString::SkipEmptyParts);
+}
+
+QList<QPair<QString, QString> > KnowledgeBase::parseTsv(const QByteArray &tsv)
+{
+    QList<QPair<QString, QString> > pairs;
+
+    for (auto &line : tsv.split('\n')) {
+        auto text = QString::fromUtf8(line);
+        if (text.endsWith('\r')) {
+            text.chop(1);
+        }
+
+        auto fields = text.split('\t');
+        if (fields.size() < 2 || fields[0].trimmed().isEmpty()) {
+            continue;
+        }
+        if (pairs.isEmpty() && fields[0] == "Question" && fields[1] == "Answer") {
+            continue;
+        }
+        // Answers are kept exactly as the service returns them, so their
+        // synthesized audio is found under the same text
+        pairs.append(qMakePair(fields[0].trimmed(), fields[1]));
+    }
+    return pairs;
+}
+
+bool KnowledgeBase::build(const QList<QPair<QString, QString> > &pairs, const QString &path)
+{
+    QVector<Document> documents;
+    QMap<quint64, QVector<Posting> > index;
+    QHash<QString, QPair<quint32, quint32> > answers;
+    QByteArray strings;
+    double totalLength = 0;
+
+    for (auto &pair : pairs) {
+        Document document;
+        QHash<QString, quint32> frequencies;
+        auto tokens = tokenize(pair.first);
+
+        for (auto &token : tokens) {
+            frequencies[token]++;
+        }
+        for (auto it = frequencies.constBegin(); it != frequencies.constEnd(); ++it) {
+            Posting posting;
+            posting.document = documents.size();
+            posting.frequency = it.value();
+            index[termHash(it.key())].append(posting);
+        }
+
+        auto question = pair.first.toUtf8();
+        document.question = strings.size();
+        document.questionLength = question.size();
+        strings.append(question);
+
+        // Alternate phrasings share their answer, so it's stored once
+        if (!answers.contains(pair.second)) {
+            auto answer = pair.second.toUtf8();
+            answers.insert(pair.second, qMakePair(static_cast<quint32>(strings.size()), static_cast<quint32>(answer.size())));
+            strings.append(answer);
+        }
+        document.answer = answers[pair.second].first;
+        document.answerLength = answers[pair.second].second;
+        document.length = tokens.size();
+        document.selfScore = 0;
+        totalLength += tokens.size();
+        documents.append(document);
+    }
+
+    Header header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.documentCount = documents.size();
+    header.termCount = index.size();
+    header.postingCount = 0;
+    header.stringsSize = strings.size();
+    header.averageLength = documents.isEmpty() ? 1 : qMax(totalLength / documents.size(), 1.0);
+
+    QVector<Term> terms;
+    QVector<Posting> postings;
+    for (auto it = index.constBegin(); it != index.constEnd(); ++it) {
+        Term term;
+        double n = it.value().size();
+        term.hash = it.key();
+        term.postings = postings.size();
+        term.count = it.value().size();
+        term.idf = std::log(1 + (documents.size() - n + 0.5) / (n + 0.5));
+        terms.append(term);
+
+        for (auto &posting : it.value()) {
+            auto &document = documents[posting.document];
+            document.selfScore += termScore(term.idf, posting.frequency, document.length, header.averageLength);
+            postings.append(posting);
+        }
+    }
+    header.postingCount = postings.size();
+
+    QDir dir(QFileInfo(path).path());
+    if (!dir.exists()) {
+        dir.mkpath(dir.path());
+    }
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(documents.constData()), documents.size() * sizeof(Document));
+    file.write(reinterpret_cast<const char *>(terms.constData()), terms.size() * sizeof(Term));
+    file.write(reinterpret_cast<const char *>(postings.constData()), postings.size() * sizeof(Posting));
+    file.write(strings);
+    return file.commit();
+}
+
+bool KnowledgeBase::open(const QString &path)
+{
+    struct stat fileStat;
+
+    close();
+    int fd = ::open(path.toUtf8().data(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &fileStat) < 0 || static_cast<size_t>(fileStat.st_size) < sizeof(Header)) {
+        ::close(fd);
+        return false;
+    }
+
+    auto data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    mData = static_cast<const uchar *>(data);
+    mSize = fileStat.st_size;
+    mHeader = reinterpret_cast<const Header *>(mData);
+
+    size_t documents = sizeof(Header);
+    size_t terms = documents + mHeader->documentCount * sizeof(Document);
+    size_t postings = terms + mHeader->termCount * sizeof(Term);
+    size_t strings = postings + mHeader->postingCount * sizeof(Posting);
+    if (memcmp(mHeader->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || strings + mHeader->stringsSize > mSize) {
+        close();
+        return false;
+    }
+
+    mDocuments = reinterpret_cast<const Document *>(mData + documents);
+    mTerms = reinterpret_cast<const Term *>(mData + terms);
+    mPostings = reinterpret_cast<const Posting *>(mData + postings);
+    mStrings = reinterpret_cast<const char *>(mData + strings);
+    return true;
+}
+
+void KnowledgeBase::close()
+{
+    if (mData) {
+        munmap(const_cast<uchar *>(mData), mSize);
+    }
+
+    mData = nullptr;
+    mSize = 0;
+    mHeader = nullptr;
+    mDocuments = nullptr;
+    mTerms = nullptr;
+    mPostings = nullptr;
+    mStrings = nullptr;
+}
+
+bool KnowledgeBase::isOpen() const
+{
+    return mData != nullptr;
+}
+
+int KnowledgeBase::size() const
+{
+    return mHeader ? mHeader->documentCount : 0;
+}
+
+QString KnowledgeBase::string(quint32 offset, quint32 length) const
+{
+    if (static_cast<quint64>(offset) + length > mHeader->stringsSize) {
+        return QString();
+    }
+    return QString::fromUtf8(mStrings + offset, length);
+}
+
+const KnowledgeBase::Term *KnowledgeBase::findTerm(quint64 hash) const
+{
+    auto end = mTerms + mHeader->termCount;
+    auto term = std::lower_bound(mTerms, end, hash, [](const Term &term, quint64 hash) {
+        return term.hash < hash;
+    });
+    return term != end && term->hash == hash ? term : nullptr;
+}
+
+QList<KnowledgeBase::Match> KnowledgeBase::search(const QString &question, int count) const
+{
+    QList<Match> matches;
+    QHash<quint32, double> scores;
+    QHash<QString, int> frequencies;
+    double queryScore = 0;
+
+    if (!isOpen()) {
+        return matches;
+    }
+
+    auto tokens = tokenize(question);
+    for (auto &token : tokens) {
+        frequencies[token]++;
+    }
+
+    // Words the knowledge base has never seen count as the rarest, so a
+    // question that adds them to a known one isn't mistaken for it
+    auto unknownIdf = std::log(1 + (mHeader->documentCount + 0.5) / 0.5);
+    for (auto it = frequencies.constBegin(); it != frequencies.constEnd(); ++it) {
+        auto term = findTerm(termHash(it.key()));
+        queryScore += termScore(term ? term->idf : unknownIdf, it.value(), tokens.size(), mHeader->averageLength);
+        if (!term || static_cast<quint64>(term->postings) + term->count > mHeader->postingCount) {
+            continue;
+        }
+        for (auto i = term->postings; i < term->postings + term->count; i++) {
+            auto &posting = mPostings[i];
+            if (posting.document < mHeader->documentCount) {
+                scores[posting.document] += termScore(term->idf, posting.frequency, mDocuments[posting.document].length, mHeader->averageLength);
+            }
+        }
+    }
+
+    // Relative to whichever of the two questions scores higher against
+    // itself, so neither one merely containing the other is a full match
+    QVector<QPair<double, quint32> > ranked;
+    for (auto it = scores.constBegin(); it != scores.constEnd(); ++it) {
+        auto selfScore = qMax(static_cast<double>(mDocuments[it.key()].selfScore), queryScore);
+        ranked.append(qMakePair(selfScore > 0 ? qMin(it.value() / selfScore, 1.0) : 0.0, it.key()));
+    }
+    std::sort(ranked.begin(), ranked.end(), [](const QPair<double, quint32> &a, const QPair<double, quint32> &b) {
+        return a.first > b.first;
+    });
+
+    // Alternate phrasings of a question lead to the same answer, which is only returned once
+    QSet<quint32> answers;
+    for (auto &entry : ranked) {
+        auto &document = mDocuments[entry.second];
+        if (matches.size() >= count) {
+            break;
+        }
+        if (answers.contains(document.answer)) {
+            continue;
+        }
+        answers.insert(document.answer);
+
+        Match match;
+        match.question = string(document.question, document.questionLength);
+        match.answer = string(document.answer, document.answerLength);
+        match.confidence = entry.first;
+        matches.append(match);
+    }
+    return matches;
+}
+
+QStringList KnowledgeBase::answers() const
+{
+    QStringList answers;
+    QSet<quint32> seen;
+
+    for (quint32 i = 0; isOpen() && i < mHeader->documentCount; i++) {
+        auto &document = mDocuments[i];
+        if (!seen.contains(document.answer)) {
+            seen.insert(document.answer);
+            answers.append(string(document.answer, document.answerLength));
+        }
+    }
+    return answers;
+}
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QStringList>
+
+namespace Bing {
+
+/**
+ * Local snapshot of the question/answer pairs of a QnA Maker knowledge
+ * base, ranked with BM25.
+ *
+ * The snapshot is one file holding the pairs and an inverted index over
+ * the questions. It's mapped into memory rather than read, so opening
+ * it is instant and several processes share its pages.
+ */
+class KnowledgeBase {
+public:
+    struct Match {
+        QString question;
+        QString answer;
+        double  confidence; // BM25 score relative to the better of either question matching itself, from 0 to 1
+    };
+
+    KnowledgeBase();
+    ~KnowledgeBase();
+
+    /**
+     * Writes the snapshot of pairs of question and answer to path
+     */
+    static bool build(const QList<QPair<QString, QString> > &pairs, const QString &path);
+
+    /**
+     * Pairs of a knowledge base exported as TSV, one "question\tanswer\tsource" per line
+     */
+    static QList<QPair<QString, QString> > parseTsv(const QByteArray &tsv);
+
+    bool open(const QString &path);
+    void close();
+    bool isOpen() const;
+    int size() const;
+
+    /**
+     * Best matches for question, most confident first
+     */
+    QList<Match> search(const QString &question, int count = 1) const;
+
+    /**
+     * Every distinct answer of the snapshot
+     */
+    QStringList answers() const;
+
+    static QStringList tokenize(const QString &text);
+
+private:
+    KnowledgeBase(const KnowledgeBase &);
+    KnowledgeBase &operator=(const KnowledgeBase &);
+
+    struct Header;
+    struct Document;
+    struct Term;
+    struct Posting;
+
+    const uchar *   mData;
+    size_t          mSize;
+    const Header *  mHeader;
+    const Document *mDocuments;
+    const Term *    mTerms;
+    const Posting * mPostings;
+    const char *    mStrings;
+
+    QString string(quint32 offset, quint32 length) const;
+    const Term *findTerm(quint64 hash) const;
+};
+
+}
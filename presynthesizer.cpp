@@ -0,0 +1,167 @@
+#include "presynthesizer.hpp"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QSaveFile>
+#include <QSet>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+namespace Bing {
+
+const QString MANIFEST_DIR = "/var/cache/bing/presynthesized/";
+
+struct Entry {
+    QString     text;
+    Voice::Font font;
+};
+
+static QString entryKey(const QString &text, const Voice::Font &font)
+{
+    return font.lang + "/" + font.gender + "/" + font.name + "\n" + text;
+}
+
+static QHash<QString, Entry> loadManifest(const QString &path)
+{
+    QHash<QString, Entry> entries;
+    QFile file(path);
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        return entries;
+    }
+    for (auto value : QJsonDocument::fromJson(file.readAll()).array()) {
+        auto obj = value.toObject();
+        Entry entry;
+        entry.text = obj["text"].toString();
+        entry.font.lang = obj["lang"].toString();
+        entry.font.gender = obj["gender"].toString();
+        entry.font.name = obj["name"].toString();
+        entries.insert(entryKey(entry.text, entry.font), entry);
+    }
+    return entries;
+}
+
+Presynthesizer::Presynthesizer(Speech *speech, QnaMaker *qnaMaker) :
+    mSpeech(speech),
+    mQnaMaker(qnaMaker)
+{
+}
+
+void Presynthesizer::setVoices(const QList<Voice::Font> &voices)
+{
+    mVoices = voices;
+}
+
+// Ids come from callers, so they're hashed rather than used as file names
+QString Presynthesizer::manifestPath(const QString &knowledgeBaseId)
+{
+    return MANIFEST_DIR + QCryptographicHash::hash(knowledgeBaseId.toUtf8(), QCryptographicHash::Sha1).toHex() + ".json";
+}
+
+Result<Presynthesizer::Report> Presynthesizer::run(const QString &knowledgeBaseId, int concurrency, const RequestOptions &options)
+{
+    auto kbId = knowledgeBaseId.isEmpty() ? mQnaMaker->knowledgeBaseId() : knowledgeBaseId;
+    Result<Report> result;
+    auto &report = result.value;
+    QHash<QString, Entry> wanted, done, missing;
+
+    // Without answers there is nothing to tell current audio from stale
+    // audio, so nothing is touched
+    if (!mQnaMaker->hasSnapshot(kbId)) {
+        return Result<Report>::failure(IOError, "No snapshot loaded");
+    }
+    auto answers = mQnaMaker->answers(kbId);
+    if (answers.isEmpty()) {
+        return Result<Report>::failure(IOError, "Snapshot has no answers");
+    }
+
+    for (auto &answer : answers) {
+        for (auto &font : mVoices) {
+            wanted.insert(entryKey(answer, font), Entry { answer, font });
+        }
+    }
+
+    // The speech cache is keyed by text and voice only, so audio another
+    // knowledge base still lists is kept
+    auto path = manifestPath(kbId);
+    auto previous = loadManifest(path);
+    QSet<QString> shared;
+    for (auto &info : QDir(MANIFEST_DIR).entryInfoList(QStringList() << "*.json", QDir::Files)) {
+        if (info.absoluteFilePath() != QFileInfo(path).absoluteFilePath()) {
+            shared.unite(loadManifest(info.absoluteFilePath()).keys().toSet());
+        }
+    }
+    for (auto it = previous.constBegin(); it != previous.constEnd(); ++it) {
+        if (!wanted.contains(it.key())) {
+            if (!shared.contains(it.key())) {
+                mSpeech->removeSynthesizeCache(it.value().text, it.value().font);
+            }
+            report.removed++;
+        }
+    }
+
+    // Cached audio is sorted out before any request starts, so only the
+    // workers below touch done and report
+    for (auto it = wanted.constBegin(); it != wanted.constEnd(); ++it) {
+        if (mSpeech->hasSynthesizeCache(it.value().text, it.value().font)) {
+            report.unchanged++;
+            done.insert(it.key(), it.value());
+        } else {
+            missing.insert(it.key(), it.value());
+        }
+    }
+
+    QThreadPool pool;
+    QMutex mutex;
+    pool.setMaxThreadCount(qMax(concurrency, 1));
+    mSpeech->setCache(true);
+    for (auto it = missing.constBegin(); it != missing.constEnd(); ++it) {
+        auto key = it.key();
+        auto entry = it.value();
+
+        QtConcurrent::run(&pool, [&, key, entry]() {
+            auto audio = mSpeech->trySynthesizeBuffer(entry.text, entry.font, options);
+
+            QMutexLocker locker(&mutex);
+            if (audio.ok()) {
+                report.synthesized++;
+                done.insert(key, entry);
+            } else {
+                report.failed++;
+            }
+        });
+    }
+    pool.waitForDone();
+
+    // Failed entries are left out, so the next run tries them again
+    QJsonArray manifest;
+    for (auto &entry : done) {
+        QJsonObject obj;
+        obj.insert("text", entry.text);
+        obj.insert("lang", entry.font.lang);
+        obj.insert("gender", entry.font.gender);
+        obj.insert("name", entry.font.name);
+        manifest.append(obj);
+    }
+
+    QDir dir(MANIFEST_DIR);
+    if (!dir.exists()) {
+        dir.mkpath(dir.path());
+    }
+    QSaveFile manifestFile(path);
+    if (manifestFile.open(QIODevice::WriteOnly)) {
+        manifestFile.write(QJsonDocument(manifest).toJson(QJsonDocument::Compact));
+        manifestFile.commit();
+    }
+
+    return result;
+}
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <QList>
+#include <QString>
+#include "qnamaker.hpp"
+#include "requestoptions.hpp"
+#include "result.hpp"
+#include "speech.hpp"
+
+namespace Bing {
+
+/**
+ * Synthesizes every answer of a knowledge base ahead of time.
+ *
+ * The audio goes into the speech cache, so speaking an answer costs one
+ * QnA request and a cache hit. A manifest records what was synthesized,
+ * so a run after the knowledge base changed only synthesizes the new
+ * answers and drops the audio of removed ones, unless the manifest of
+ * another knowledge base still lists it.
+ */
+class Presynthesizer {
+public:
+    struct Report {
+        int synthesized;
+        int unchanged;
+        int removed;
+        int failed;
+    };
+
+    Presynthesizer(Speech *speech, QnaMaker *qnaMaker);
+
+    void setVoices(const QList<Voice::Font> &voices);
+
+    /**
+     * Brings the cached audio in line with the answers of the loaded
+     * snapshot of knowledgeBaseId, see QnaMaker::downloadSnapshot(). Fails
+     * without touching any audio if no snapshot with answers is loaded.
+     * Turns on the speech cache.
+     *
+     * \param concurrency Synthesis requests sent at once
+     * \param options Options of every request, e.g. with RequestOptions::Batch priority
+     */
+    Result<Report> run(const QString &knowledgeBaseId = QString(), int concurrency = 4, const RequestOptions &options = RequestOptions());
+
+private:
+    Speech *           mSpeech;
+    QnaMaker *         mQnaMaker;
+    QList<Voice::Font> mVoices;
+
+    static QString manifestPath(const QString &knowledgeBaseId);
+};
+
+}
@@ -1,32 +1,42 @@
 #include "qnamaker.hpp"
+#include "session.hpp"
+#include "router.hpp"
+#include "ratelimiter.hpp"
+#include "responsebuffer.hpp"
 #include "exception.hpp"
 
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QThreadPool>
+#include <QtConcurrent>
 
 namespace Bing {
 
+const QString QNAMAKER_PATH = "/qnamaker/v2.0/knowledgebases/";
+const QString ANSWER_CACHE_DIR = "/var/cache/bing/qnamaker/answers/";
+const QString SNAPSHOT_DIR = "/var/cache/bing/qnamaker/snapshots/";
+const int ANSWER_CACHE_ENTRIES = 4096; // Answers kept in memory
+const double DEFAULT_SNAPSHOT_CONFIDENCE = 0.8;
+
 QnaMaker::QnaMaker(int log, QObject *parent) :
-    QObject(parent)
+    QObject(parent),
+    mHedging(false),
+    mCache(false),
+    mCacheTtl(0),
+    mMemoryCache(ANSWER_CACHE_ENTRIES),
+    mFuzzy(false),
+    mFuzzyThreshold(0),
+    mSnapshotConfidence(DEFAULT_SNAPSHOT_CONFIDENCE)
 {
-    SoupLogger *logger;
-    SoupLoggerLogLevel logLevel;
-
-    if (log <= 0) {
-        logLevel = SOUP_LOGGER_LOG_NONE;
-    } else if (log == 1) {
-        logLevel = SOUP_LOGGER_LOG_MINIMAL;
-    } else if (log == 2) {
-        logLevel = SOUP_LOGGER_LOG_HEADERS;
-    } else {
-        logLevel = SOUP_LOGGER_LOG_BODY;
-    }
-
-    mSession = soup_session_new_with_options(SOUP_SESSION_ADD_FEATURE_BY_TYPE, SOUP_TYPE_CONTENT_SNIFFER, NULL);
-    logger = soup_logger_new(logLevel, -1);
-    soup_session_add_feature(mSession, SOUP_SESSION_FEATURE(logger));
-    g_object_unref(logger);
+    Session::instance()->enableLogging(log);
+    mSession = Session::instance()->soup();
+    g_object_ref(mSession);
 }
 
 QnaMaker::~QnaMaker()
@@ -39,7 +49,14 @@ QnaMaker::~QnaMaker()
 
 void QnaMaker::setSubscriptionKey(const QString &subscriptionKey)
 {
-    mSubscriptionKey = subscriptionKey;
+    mSubscriptionKeys.setKeys(QStringList() << subscriptionKey);
+}
+
+void QnaMaker::setSubscriptionKeys(const QStringList &subscriptionKeys, KeyPool::Strategy strategy, int requestsPerMinute)
+{
+    mSubscriptionKeys.setKeys(subscriptionKeys);
+    mSubscriptionKeys.setStrategy(strategy);
+    mSubscriptionKeys.setQuota(requestsPerMinute);
 }
 
 void QnaMaker::setKnowledgeBaseId(const QString &knowledgeBaseId)
@@ -47,20 +64,332 @@ void QnaMaker::setKnowledgeBaseId(const QString &knowledgeBaseId)
     mKnowledgeBaseId = knowledgeBaseId;
 }
 
-QString QnaMaker::generateAnswer(const QString &question, const QString &knowledgeBaseId, int count)
+QString QnaMaker::knowledgeBaseId() const
+{
+    return mKnowledgeBaseId;
+}
+
+void QnaMaker::prewarm(int connections, bool wait)
+{
+    Session::instance()->prewarm(Router::instance()->endpoints(Router::QnaMakerService), connections, wait);
+}
+
+void QnaMaker::setHedging(bool hedging)
+{
+    mHedging = hedging;
+}
+
+void QnaMaker::setCache(bool cache, int ttl)
+{
+    mCache = cache;
+    mCacheTtl = ttl;
+}
+
+void QnaMaker::setFuzzyMatching(bool fuzzy, double threshold)
+{
+    mFuzzy = fuzzy;
+    mFuzzyThreshold = threshold;
+}
+
+// Ids come from callers, so they're hashed rather than used as paths, where
+// e.g. ".." or an empty id would reach other knowledge bases' files
+QString QnaMaker::storageName(const QString &knowledgeBaseId)
+{
+    return QCryptographicHash::hash(knowledgeBaseId.toUtf8(), QCryptographicHash::Sha1).toHex();
+}
+
+QString QnaMaker::snapshotPath(const QString &knowledgeBaseId)
+{
+    return SNAPSHOT_DIR + storageName(knowledgeBaseId);
+}
+
+QSharedPointer<KnowledgeBase> QnaMaker::snapshot(const QString &knowledgeBaseId)
+{
+    QMutexLocker locker(&mSnapshotMutex);
+    return mSnapshots.value(knowledgeBaseId);
+}
+
+bool QnaMaker::hasSnapshot(const QString &knowledgeBaseId)
+{
+    return !snapshot(knowledgeBaseId.isEmpty() ? mKnowledgeBaseId : knowledgeBaseId).isNull();
+}
+
+QStringList QnaMaker::answers(const QString &knowledgeBaseId)
+{
+    auto snapshot = this->snapshot(knowledgeBaseId.isEmpty() ? mKnowledgeBaseId : knowledgeBaseId);
+    return snapshot ? snapshot->answers() : QStringList();
+}
+
+void QnaMaker::setSnapshotConfidence(double confidence)
+{
+    mSnapshotConfidence = confidence;
+}
+
+bool QnaMaker::loadSnapshot(const QString &knowledgeBaseId)
+{
+    auto kbId = knowledgeBaseId.isEmpty() ? mKnowledgeBaseId : knowledgeBaseId;
+    QSharedPointer<KnowledgeBase> snapshot(new KnowledgeBase());
+
+    if (kbId.isEmpty() || !snapshot->open(snapshotPath(kbId))) {
+        return false;
+    }
+
+    // Searches still running keep the previous snapshot mapped until they're done
+    QMutexLocker locker(&mSnapshotMutex);
+    mSnapshots.insert(kbId, snapshot);
+    return true;
+}
+
+// The service answers with a short-lived URL of the knowledge base as TSV
+Result<int> QnaMaker::downloadSnapshot(const QString &knowledgeBaseId, const RequestOptions &options)
+{
+    Result<int> result;
+    QElapsedTimer timer;
+    auto kbId = knowledgeBaseId.isEmpty() ? mKnowledgeBaseId : knowledgeBaseId;
+
+    if (kbId.isEmpty()) {
+        return Result<int>::failure(IOError, "No knowledge base");
+    }
+
+    auto msg = soup_message_new("GET", (Router::instance()->select(Router::QnaMakerService) + QNAMAKER_PATH + kbId).toUtf8().data());
+    timer.start();
+    auto httpStatusCode = send(msg, options);
+    result.setResponse(msg, httpStatusCode, timer);
+    if (!result.ok()) {
+        g_object_unref(msg);
+        return result;
+    }
+
+    auto location = QJsonDocument::fromJson("[" + ResponseBuffer::take(msg).toByteArray() + "]").array()[0].toString();
+    msg = soup_message_new("GET", location.toUtf8().data());
+    if (!msg) {
+        return Result<int>::failure(IOError, "Invalid download URL");
+    }
+    httpStatusCode = Session::instance()->send(msg, Session::Prepare(), true, options);
+    result.setResponse(msg, httpStatusCode, timer);
+    if (!result.ok()) {
+        g_object_unref(msg);
+        return result;
+    }
+
+    auto pairs = KnowledgeBase::parseTsv(ResponseBuffer::take(msg).bytes());
+    if (!KnowledgeBase::build(pairs, snapshotPath(kbId)) || !loadSnapshot(kbId)) {
+        result.error = IOError;
+        result.reason = "Could not save the snapshot";
+        return result;
+    }
+
+    // The cache and the fuzzy index are consulted first and may hold answers
+    // the knowledge base no longer gives
+    invalidate(kbId);
+
+    result.value = pairs.size();
+    return result;
+}
+
+void QnaMaker::invalidate(const QString &knowledgeBaseId)
+{
+    if (knowledgeBaseId.isEmpty()) {
+        return;
+    }
+
+    QMutexLocker locker(&mCacheMutex);
+    auto prefix = knowledgeBaseId + "/";
+
+    mIndex.remove(prefix);
+    for (auto &key : mMemoryCache.keys()) {
+        if (key.startsWith(prefix)) {
+            mMemoryCache.remove(key);
+        }
+    }
+    QDir(ANSWER_CACHE_DIR + storageName(knowledgeBaseId)).removeRecursively();
+}
+
+// Case, punctuation and spacing rarely change what's being asked
+QString QnaMaker::answerCacheKey(const QString &question, const QString &knowledgeBaseId, int count)
+{
+    QString normalized;
+
+    for (auto c : question.toCaseFolded()) {
+        normalized.append(c.isLetterOrNumber() ? c : QChar(' '));
+    }
+    return knowledgeBaseId + "/" + QString::number(count) + "/" + normalized.simplified();
+}
+
+QString QnaMaker::answerCachePath(const QString &knowledgeBaseId, const QString &key)
+{
+    auto hash = QString(QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex());
+    return ANSWER_CACHE_DIR + storageName(knowledgeBaseId) + "/" + hash.left(2) + "/" + hash;
+}
+
+// Entries on disk expire by their modification time, so a new TTL applies to them too
+bool QnaMaker::findAnswerCache(const QString &knowledgeBaseId, const QString &key, QByteArray *response)
+{
+    auto now = QDateTime::currentMSecsSinceEpoch();
+    QMutexLocker locker(&mCacheMutex);
+
+    auto cached = mMemoryCache.object(key);
+    if (cached) {
+        if (now < cached->saved + mCacheTtl * 1000LL) {
+            *response = cached->response;
+            return true;
+        }
+        mMemoryCache.remove(key);
+    }
+    locker.unlock();
+
+    auto path = answerCachePath(knowledgeBaseId, key);
+    QFileInfo info(path);
+    QFile file(path);
+    auto saved = info.lastModified().toMSecsSinceEpoch();
+    if (!info.exists() || now >= saved + mCacheTtl * 1000LL || !file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    auto entry = new CachedAnswer { file.readAll(), saved };
+    *response = entry->response;
+    locker.relock();
+    mMemoryCache.insert(key, entry);
+    return true;
+}
+
+void QnaMaker::saveAnswerCache(const QString &knowledgeBaseId, const QString &key, const QByteArray &response)
+{
+    auto path = answerCachePath(knowledgeBaseId, key);
+    QDir dir(QFileInfo(path).path());
+    QSaveFile file(path);
+
+    mCacheMutex.lock();
+    mMemoryCache.insert(key, new CachedAnswer { QByteArray(response.constData(), response.size()), QDateTime::currentMSecsSinceEpoch() });
+    mCacheMutex.unlock();
+
+    if (!dir.exists()) {
+        dir.mkpath(dir.path());
+    }
+    if (file.open(QIODevice::WriteOnly)) {
+        file.write(response);
+        file.commit();
+    }
+}
+
+QList<Answer> QnaMaker::parseAnswers(const QByteArray &response)
+{
+    QList<Answer> answers;
+    auto answersArray = QJsonDocument::fromJson(response).object()["answers"].toArray();
+
+    for (auto value : answersArray) {
+        auto answerObj = value.toObject();
+        Answer answer;
+        answer.answer = answerObj["answer"].toString();
+        answer.score = answerObj["score"].toDouble();
+        for (auto question : answerObj["questions"].toArray()) {
+            answer.questions.append(question.toString());
+        }
+        answers.append(answer);
+    }
+    return answers;
+}
+
+// Sends msg with the next key in the pool, moving on to another key when
+// the session retries
+guint QnaMaker::send(SoupMessage *msg, const RequestOptions &options)
 {
+    QString subscriptionKey;
+    auto prepare = [&](SoupMessage *msg, int attempt) {
+        if (attempt > 0) {
+            mSubscriptionKeys.report(subscriptionKey, msg);
+        }
+        subscriptionKey = mSubscriptionKeys.acquire();
+        RateLimiter::instance()->acquire(Router::QnaMakerService, subscriptionKey, options);
+        soup_message_headers_replace(msg->request_headers, "Ocp-Apim-Subscription-Key", subscriptionKey.toUtf8().data());
+    };
+
+    auto httpStatusCode = Session::instance()->send(msg, Router::instance()->route(Router::QnaMakerService, prepare), true, options);
+    mSubscriptionKeys.report(subscriptionKey, msg);
+
+    return httpStatusCode;
+}
+
+QString QnaMaker::generateAnswer(const QString &question, const QString &knowledgeBaseId, int count, const RequestOptions &options)
+{
+    return tryGenerateAnswer(question, knowledgeBaseId, count, options).get();
+}
+
+Result<QString> QnaMaker::tryGenerateAnswer(const QString &question, const QString &knowledgeBaseId, int count, const RequestOptions &options)
+{
+    auto result = tryGenerateAnswers(question, knowledgeBaseId, count, options);
+    QString answer;
+
+    if (!result.value.isEmpty() && result.value[0].score > 0) {
+        answer = result.value[0].answer;
+    }
+    return result.withValue(answer);
+}
+
+QList<Result<QList<Answer> > > QnaMaker::generateAnswerBatch(const QStringList &questions, const QString &knowledgeBaseId, int count, int concurrency, const RequestOptions &options)
+{
+    QThreadPool pool;
+    QVector<Result<QList<Answer> > > results(questions.size());
+
+    // Every request blocks its thread, so the pool size is the number in flight
+    pool.setMaxThreadCount(qMax(concurrency, 1));
+    for (auto i = 0; i < questions.size(); i++) {
+        QtConcurrent::run(&pool, [&, i]() {
+            results[i] = tryGenerateAnswers(questions[i], knowledgeBaseId, count, options);
+        });
+    }
+    pool.waitForDone();
+
+    return results.toList();
+}
+
+Result<QList<Answer> > QnaMaker::tryGenerateAnswers(const QString &question, const QString &knowledgeBaseId, int count, const RequestOptions &options)
+{
+    Result<QList<Answer> > result;
+    QElapsedTimer timer;
     SoupMessage *msg;
-    SoupMessageBody *body;
-    QString url = "https://westus.api.cognitive.microsoft.com/qnamaker/v2.0/knowledgebases/";
+    auto kbId = knowledgeBaseId.isEmpty() ? mKnowledgeBaseId : knowledgeBaseId;
 
-    if (!knowledgeBaseId.isEmpty()) {
-        url += knowledgeBaseId + "/generateAnswer";
-    } else if (knowledgeBaseId.isEmpty() && !mKnowledgeBaseId.isEmpty()) {
-        url += mKnowledgeBaseId + "/generateAnswer";
-    } else {
-        return QString();
+    if (kbId.isEmpty()) {
+        return result;
+    }
+
+    QString cacheKey;
+    if (mCache) {
+        QByteArray response;
+        cacheKey = answerCacheKey(question, kbId, count);
+        if (findAnswerCache(kbId, cacheKey, &response)) {
+            return Result<QList<Answer> >::cached(parseAnswers(response));
+        }
+    }
+
+    auto snapshot = this->snapshot(kbId);
+    if (snapshot) {
+        auto matches = snapshot->search(question, count);
+        if (!matches.isEmpty() && matches[0].confidence >= mSnapshotConfidence) {
+            QList<Answer> answers;
+            for (auto &match : matches) {
+                Answer answer;
+                answer.answer = match.answer;
+                answer.questions.append(match.question);
+                answer.score = match.confidence * 100;
+                answers.append(answer);
+            }
+            return Result<QList<Answer> >::cached(answers);
+        }
     }
 
+    auto scope = kbId + "/" + QString::number(count);
+    if (mFuzzy) {
+        QByteArray response;
+        if (mIndex.find(scope, question, mFuzzyThreshold, &response)) {
+            return Result<QList<Answer> >::cached(parseAnswers(response));
+        }
+    }
+
+    auto baseUrl = Router::instance()->select(Router::QnaMakerService);
+    QString url = baseUrl + QNAMAKER_PATH + kbId + "/generateAnswer";
+
     // Build request JSON
     QJsonObject obj;
     obj.insert("question", question);
@@ -71,24 +400,34 @@ QString QnaMaker::generateAnswer(const QString &question, const QString &knowled
     // Send the request
     msg = soup_message_new("POST", url.toUtf8().data());
     soup_message_set_request(msg, "application/json", SOUP_MEMORY_COPY, data.data(), data.size());
-    soup_message_headers_append(msg->request_headers, "Ocp-Apim-Subscription-Key", mSubscriptionKey.toUtf8().data());
-    int httpStatusCode = soup_session_send_message(mSession, msg);
-    if (httpStatusCode >= 400) {
-        throw Exception(HTTPError);
+    guint httpStatusCode;
+    timer.start();
+    if (mHedging) {
+        auto alternate = Router::instance()->select(Router::QnaMakerService, QStringList() << baseUrl);
+        httpStatusCode = Session::instance()->hedge(msg, [this, &options](SoupMessage *msg) {
+            return send(msg, options);
+        }, alternate);
+    } else {
+        httpStatusCode = send(msg, options);
+    }
+    result.setResponse(msg, httpStatusCode, timer);
+    if (!result.ok()) {
+        g_object_unref(msg);
+        return result;
     }
 
     // Get answer
-    g_object_get(msg, "response-body", &body, NULL);
-    QByteArray answerJson(body->data, body->length);
-    auto answersObj = QJsonDocument::fromJson(answerJson).object();
-    auto answersArray = answersObj["answers"].toArray();
-    auto answerObj = answersArray[0].toObject();
-    auto answer = answerObj["answer"].toString();
-    auto score = answerObj["score"].toDouble();
-    if (score > 0) {
-        return answer;
-    }
-    return QString();
+    auto body = ResponseBuffer::take(msg);
+    result.value = parseAnswers(body.bytes());
+    if (!cacheKey.isEmpty()) {
+        saveAnswerCache(kbId, cacheKey, body.bytes());
+    }
+
+    // Only questions the knowledge base could answer are worth matching
+    if (mFuzzy && !result.value.isEmpty() && result.value[0].score > 0) {
+        mIndex.insert(scope, question, body.toByteArray());
+    }
+    return result;
 }
 
 }
\ No newline at end of file
@@ -2,9 +2,23 @@
 
 #include <libsoup/soup.h>
 #include <QObject>
+#include <QCache>
+#include <QMutex>
+#include <QSharedPointer>
+#include "keypool.hpp"
+#include "knowledgebase.hpp"
+#include "questionindex.hpp"
+#include "requestoptions.hpp"
+#include "result.hpp"
 
 namespace Bing {
 
+struct Answer {
+    QString     answer;
+    QStringList questions; // Questions of the knowledge base the answer belongs to
+    double      score;     // From 0 to 100
+};
+
 class QnaMaker : public QObject {
     Q_OBJECT
 public:
@@ -12,13 +26,121 @@ public:
     ~QnaMaker();
 
     void setSubscriptionKey(const QString &subscriptionKey);
+    void setSubscriptionKeys(const QStringList &subscriptionKeys, KeyPool::Strategy strategy = KeyPool::LeastRecentlyUsed, int requestsPerMinute = 0);
     void setKnowledgeBaseId(const QString &knowledgeBaseId);
-    QString generateAnswer(const QString &question, const QString &knowledgeBaseId = QString(), int count = 1);
+    QString knowledgeBaseId() const;
+    void prewarm(int connections = 1, bool wait = false);
+
+    /**
+     * Races a duplicate request against ones slower than usual, see
+     * Session::setHedging()
+     */
+    void setHedging(bool hedging);
+
+    /**
+     * Answers questions asked before from memory or disk instead of the
+     * service. Questions match after case folding and dropping punctuation
+     * and extra whitespace, for the same knowledge base and answer count.
+     *
+     * \param cache Whether to use the cache
+     * \param ttl Seconds an answer is served from the cache
+     */
+    void setCache(bool cache, int ttl = 24 * 3600);
+
+    /**
+     * Answers questions that are worded like one answered before from
+     * memory, e.g. "password reset how" after "how do I reset my password",
+     * see QuestionIndex
+     *
+     * \param fuzzy Whether to match similar questions
+     * \param threshold Similarity from 0 to 1 a question needs to match
+     */
+    void setFuzzyMatching(bool fuzzy, double threshold = 0.6);
+
+    /**
+     * Downloads knowledgeBaseId and stores it as a local snapshot, which then
+     * answers questions it's confident about without asking the service
+     *
+     * \return Number of question/answer pairs in the snapshot
+     */
+    Result<int> downloadSnapshot(const QString &knowledgeBaseId = QString(), const RequestOptions &options = RequestOptions());
+
+    /**
+     * Opens the stored snapshot of knowledgeBaseId, e.g. at startup; false if there is none
+     */
+    bool loadSnapshot(const QString &knowledgeBaseId = QString());
+
+    /**
+     * Confidence, from 0 to 1, a snapshot's answer needs to be returned
+     * without asking the service
+     */
+    void setSnapshotConfidence(double confidence);
+
+    /**
+     * Whether a snapshot of knowledgeBaseId is loaded
+     */
+    bool hasSnapshot(const QString &knowledgeBaseId = QString());
+
+    /**
+     * Every distinct answer of the loaded snapshot of knowledgeBaseId
+     */
+    QStringList answers(const QString &knowledgeBaseId = QString());
+
+    /**
+     * Drops every cached answer of knowledgeBaseId, e.g. after it's republished
+     */
+    void invalidate(const QString &knowledgeBaseId);
+    QString generateAnswer(const QString &question, const QString &knowledgeBaseId = QString(), int count = 1, const RequestOptions &options = RequestOptions());
+
+    /**
+     * Same as generateAnswer(), but failures are returned instead of thrown
+     */
+    Result<QString> tryGenerateAnswer(const QString &question, const QString &knowledgeBaseId = QString(), int count = 1, const RequestOptions &options = RequestOptions());
+
+    /**
+     * Up to count answers to question with their scores, best first
+     */
+    Result<QList<Answer> > tryGenerateAnswers(const QString &question, const QString &knowledgeBaseId = QString(), int count = 1, const RequestOptions &options = RequestOptions());
+
+    /**
+     * Answers every question, sending up to concurrency requests at once,
+     * and returns the results in the order of questions. Background jobs
+     * should pass options with RequestOptions::Batch priority.
+     */
+    QList<Result<QList<Answer> > > generateAnswerBatch(const QStringList &questions, const QString &knowledgeBaseId = QString(), int count = 1, int concurrency = 8, const RequestOptions &options = RequestOptions());
 
 private:
     SoupSession * mSession;
-    QString       mSubscriptionKey;
+    KeyPool       mSubscriptionKeys;
     QString       mKnowledgeBaseId;
+    bool          mHedging;
+    bool          mCache;
+    int           mCacheTtl;
+
+    struct CachedAnswer {
+        QByteArray response;
+        qint64     saved;
+    };
+
+    QCache<QString, CachedAnswer> mMemoryCache;
+    QMutex                        mCacheMutex;
+    QuestionIndex                 mIndex;
+    bool                          mFuzzy;
+    double                        mFuzzyThreshold;
+
+    QHash<QString, QSharedPointer<KnowledgeBase> > mSnapshots;
+    QMutex                                         mSnapshotMutex;
+    double                                         mSnapshotConfidence;
+
+    guint send(SoupMessage *msg, const RequestOptions &options);
+    static QList<Answer> parseAnswers(const QByteArray &response);
+    static QString storageName(const QString &knowledgeBaseId);
+    static QString snapshotPath(const QString &knowledgeBaseId);
+    QSharedPointer<KnowledgeBase> snapshot(const QString &knowledgeBaseId);
+    static QString answerCacheKey(const QString &question, const QString &knowledgeBaseId, int count);
+    static QString answerCachePath(const QString &knowledgeBaseId, const QString &key);
+    bool findAnswerCache(const QString &knowledgeBaseId, const QString &key, QByteArray *response);
+    void saveAnswerCache(const QString &knowledgeBaseId, const QString &key, const QByteArray &response);
 };
 
 }
\ No newline at end of file
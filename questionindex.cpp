@@ -0,0 +1,217 @@
+#include "questionindex.hpp"
+
+#include <QSet>
+#include <QStringList>
+#include <algorithm>
+
+namespace Bing {
+
+const int SIGNATURE_SIZE = 60; // MinHash values per question
+const int BAND_ROWS      = 3;  // Values per band; 20 bands find over 90% of pairs above 0.5 similarity
+
+// splitmix64 finalizer, a cheap hash with good avalanche
+static quint64 mix(quint64 x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+QuestionIndex::QuestionIndex(int capacity) :
+    mCapacity(qMax(capacity, 1)),
+    mNextId(0),
+    mSize(0),
+    mEntries(mCapacity)
+{
+    for (auto &entry : mEntries) {
+        entry.id = -1;
+    }
+}
+
+// Trigrams are taken per word, with its boundaries marked, so they don't
+// depend on word order
+QVector<quint32> QuestionIndex::shingles(const QString &question)
+{
+    QString normalized;
+    QVector<quint32> result;
+
+    for (auto c : question.toCaseFolded()) {
+        normalized.append(c.isLetterOrNumber() ? c : QChar(' '));
+    }
+
+    for (auto &word : normalized.split(' ', QString::SkipEmptyParts)) {
+        auto padded = "^" + word + "$";
+        for (auto i = 0; i + 3 <= padded.size(); i++) {
+            quint32 hash = 2166136261u;
+            for (auto j = i; j < i + 3; j++) {
+                hash = (hash ^ padded[j].unicode()) * 16777619u;
+            }
+            result.append(hash);
+        }
+    }
+
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+QVector<quint64> QuestionIndex::bands(const QString &scope, const QVector<quint32> &shingles)
+{
+    quint64 signature[SIGNATURE_SIZE];
+    QVector<quint64> keys;
+    auto scopeHash = static_cast<quint64>(qHash(scope));
+
+    for (auto i = 0; i < SIGNATURE_SIZE; i++) {
+        signature[i] = ~0ULL;
+        for (auto shingle : shingles) {
+            signature[i] = qMin(signature[i], mix(shingle + (static_cast<quint64>(i) << 32)));
+        }
+    }
+
+    for (auto band = 0; band < SIGNATURE_SIZE / BAND_ROWS; band++) {
+        auto key = mix(scopeHash + band);
+        for (auto row = 0; row < BAND_ROWS; row++) {
+            key = mix(key ^ signature[band * BAND_ROWS + row]);
+        }
+        keys.append(key);
+    }
+    return keys;
+}
+
+double QuestionIndex::jaccard(const QVector<quint32> &a, const QVector<quint32> &b)
+{
+    int common = 0;
+    auto i = a.constBegin(), j = b.constBegin();
+
+    while (i != a.constEnd() && j != b.constEnd()) {
+        if (*i < *j) {
+            ++i;
+        } else if (*j < *i) {
+            ++j;
+        } else {
+            common++;
+            ++i;
+            ++j;
+        }
+    }
+
+    auto total = a.size() + b.size() - common;
+    return total > 0 ? static_cast<double>(common) / total : 0;
+}
+
+double QuestionIndex::similarity(const QString &a, const QString &b)
+{
+    return jaccard(shingles(a), shingles(b));
+}
+
+void QuestionIndex::insert(const QString &scope, const QString &question, const QByteArray &value)
+{
+    auto questionShingles = shingles(question);
+    if (questionShingles.isEmpty()) {
+        return;
+    }
+
+    auto keys = bands(scope, questionShingles);
+    QWriteLocker locker(&mLock);
+
+    // The same question again only updates its value
+    for (auto id : mBuckets.value(keys[0])) {
+        auto &entry = mEntries[id % mCapacity];
+        if (entry.scope == scope && entry.shingles == questionShingles) {
+            entry.value = value;
+            return;
+        }
+    }
+
+    auto id = mNextId++;
+    auto &entry = mEntries[id % mCapacity];
+    if (entry.id >= 0) {
+        for (auto key : bands(entry.scope, entry.shingles)) {
+            auto &bucket = mBuckets[key];
+            bucket.removeOne(entry.id);
+            if (bucket.isEmpty()) {
+                mBuckets.remove(key);
+            }
+        }
+        mSize--;
+    }
+
+    entry.id = id;
+    entry.scope = scope;
+    entry.shingles = questionShingles;
+    entry.value = value;
+    mSize++;
+    for (auto key : keys) {
+        mBuckets[key].append(id);
+    }
+}
+
+bool QuestionIndex::find(const QString &scope, const QString &question, double threshold, QByteArray *value, double *similarity) const
+{
+    auto questionShingles = shingles(question);
+    if (questionShingles.isEmpty()) {
+        return false;
+    }
+
+    auto keys = bands(scope, questionShingles);
+    QReadLocker locker(&mLock);
+    QSet<qint64> seen;
+    double best = -1;
+
+    for (auto key : keys) {
+        for (auto id : mBuckets.value(key)) {
+            if (seen.contains(id)) {
+                continue;
+            }
+            seen.insert(id);
+
+            auto &entry = mEntries[id % mCapacity];
+            if (entry.scope != scope) {
+                continue;
+            }
+            auto score = jaccard(questionShingles, entry.shingles);
+            if (score >= threshold && score > best) {
+                best = score;
+                *value = entry.value;
+            }
+        }
+    }
+
+    if (similarity && best >= 0) {
+        *similarity = best;
+    }
+    return best >= 0;
+}
+
+void QuestionIndex::remove(const QString &scopePrefix)
+{
+    QWriteLocker locker(&mLock);
+
+    for (auto &entry : mEntries) {
+        if (entry.id < 0 || !entry.scope.startsWith(scopePrefix)) {
+            continue;
+        }
+        for (auto key : bands(entry.scope, entry.shingles)) {
+            auto &bucket = mBuckets[key];
+            bucket.removeOne(entry.id);
+            if (bucket.isEmpty()) {
+                mBuckets.remove(key);
+            }
+        }
+        entry.id = -1;
+        entry.shingles.clear();
+        entry.value.clear();
+        mSize--;
+    }
+}
+
+int QuestionIndex::size() const
+{
+    QReadLocker locker(&mLock);
+    return mSize;
+}
+
+}
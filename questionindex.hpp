@@ -0,0 +1,70 @@
+#pragma once
+
+#include <QByteArray>
+#include <QHash>
+#include <QReadWriteLock>
+#include <QString>
+#include <QVector>
+
+namespace Bing {
+
+/**
+ * Finds previously answered questions that are worded differently.
+ *
+ * A question is reduced to the set of character trigrams of its words,
+ * so word order, small typos and inflections change little of it.
+ * MinHash signatures split into bands (locality-sensitive hashing) pick
+ * a few candidates, whose exact Jaccard similarity then decides the
+ * match. Lookups never scan the whole index.
+ *
+ * Entries belong to a scope, e.g. a knowledge base and answer count, and
+ * only match questions of the same scope. The oldest entries are
+ * replaced once the index is full.
+ */
+class QuestionIndex {
+public:
+    QuestionIndex(int capacity = 16384);
+
+    void insert(const QString &scope, const QString &question, const QByteArray &value);
+
+    /**
+     * Value of the most similar question of scope, if its similarity is at
+     * least threshold
+     *
+     * \param similarity Set to the Jaccard similarity of the match, may be null
+     */
+    bool find(const QString &scope, const QString &question, double threshold, QByteArray *value, double *similarity = nullptr) const;
+
+    /**
+     * Drops the entries of every scope starting with prefix
+     */
+    void remove(const QString &scopePrefix);
+
+    int size() const;
+
+    /**
+     * Similarity of two questions as used by the index, from 0 to 1
+     */
+    static double similarity(const QString &a, const QString &b);
+
+private:
+    struct Entry {
+        qint64           id;
+        QString          scope;
+        QVector<quint32> shingles; // Sorted
+        QByteArray       value;
+    };
+
+    mutable QReadWriteLock          mLock;
+    int                             mCapacity;
+    qint64                          mNextId;
+    int                             mSize;
+    QVector<Entry>                  mEntries; // Ring of mCapacity slots, indexed by id
+    QHash<quint64, QVector<qint64> > mBuckets;
+
+    static QVector<quint32> shingles(const QString &question);
+    static QVector<quint64> bands(const QString &scope, const QVector<quint32> &shingles);
+    static double jaccard(const QVector<quint32> &a, const QVector<quint32> &b);
+};
+
+}
@@ -0,0 +1,171 @@
+#include "ratelimiter.hpp"
+
+#include <QDateTime>
+#include <cmath>
+
+namespace Bing {
+
+const int MAX_WAIT = 50; // Milliseconds between checks for cancellation while waiting
+
+static QString bucketId(int service, const QString &key)
+{
+    return QString::number(service) + "/" + key;
+}
+
+RateLimiter *RateLimiter::instance()
+{
+    static RateLimiter limiter;
+    return &limiter;
+}
+
+RateLimiter::RateLimiter() :
+    mTickets(0)
+{
+}
+
+RateLimiter::~RateLimiter()
+{
+    qDeleteAll(mBuckets);
+}
+
+void RateLimiter::setRate(Router::Service service, double perSecond, int burst)
+{
+    QMutexLocker locker(&mMutex);
+    Rate rate;
+
+    rate.perSecond = perSecond;
+    rate.burst = qMax(burst, 1);
+    mServiceRates[service] = rate;
+    for (auto id : mBuckets.keys()) {
+        auto bucket = mBuckets[id];
+        if (bucket->service == service) {
+            bucket->rate = rateOf(service, id);
+        }
+    }
+    mChanged.wakeAll();
+}
+
+void RateLimiter::setRate(Router::Service service, const QString &key, double perSecond, int burst)
+{
+    QMutexLocker locker(&mMutex);
+    auto id = bucketId(service, key);
+    Rate rate;
+
+    rate.perSecond = perSecond;
+    rate.burst = qMax(burst, 1);
+    mKeyRates[id] = rate;
+    if (mBuckets.contains(id)) {
+        mBuckets[id]->rate = rate;
+    }
+    mChanged.wakeAll();
+}
+
+RateLimiter::Rate RateLimiter::rateOf(int service, const QString &id) const
+{
+    if (mKeyRates.contains(id)) {
+        return mKeyRates[id];
+    }
+    if (mServiceRates.contains(service)) {
+        return mServiceRates[service];
+    }
+
+    Rate unlimited;
+    unlimited.perSecond = 0;
+    unlimited.burst = 1;
+    return unlimited;
+}
+
+void RateLimiter::refill(Bucket *bucket, qint64 now)
+{
+    auto elapsed = now - bucket->refilled;
+
+    bucket->refilled = now;
+    bucket->tokens = qMin(static_cast<double>(bucket->rate.burst), bucket->tokens + elapsed * bucket->rate.perSecond / 1000);
+}
+
+bool RateLimiter::acquire(Router::Service service, const QString &key, const RequestOptions &options)
+{
+    QMutexLocker locker(&mMutex);
+    auto id = bucketId(service, key);
+    auto now = QDateTime::currentMSecsSinceEpoch();
+    auto start = now;
+    auto priority = options.priority == RequestOptions::Batch ? RequestOptions::Batch : RequestOptions::Interactive;
+
+    auto bucket = mBuckets.value(id);
+    if (!bucket) {
+        auto rate = rateOf(service, id);
+        if (rate.perSecond <= 0) {
+            return true;
+        }
+
+        // A new key starts with a full burst
+        bucket = new Bucket();
+        bucket->service = service;
+        bucket->rate = rate;
+        bucket->tokens = rate.burst;
+        bucket->refilled = now;
+        mBuckets.insert(id, bucket);
+    }
+
+    auto ticket = ++mTickets;
+    auto &queue = bucket->waiting[priority];
+    auto &interactive = bucket->waiting[RequestOptions::Interactive];
+    queue.enqueue(ticket);
+
+    forever {
+        if (bucket->rate.perSecond <= 0) {
+            queue.removeOne(ticket);
+            mChanged.wakeAll();
+            return true;
+        }
+
+        // Requests of one priority are served in order, and batch requests
+        // only once no interactive request is waiting
+        refill(bucket, now);
+        bool next = queue.head() == ticket && (priority == RequestOptions::Interactive || interactive.isEmpty());
+        if (next && bucket->tokens >= 1) {
+            bucket->tokens -= 1;
+            queue.dequeue();
+            mStats[service].granted++;
+            mStats[service].waitedMsecs += now - start;
+            mChanged.wakeAll();
+            return true;
+        }
+
+        if (options.token.isCancelled() || (options.deadline > 0 && now >= options.deadline)) {
+            queue.removeOne(ticket);
+            mChanged.wakeAll();
+            return false;
+        }
+
+        int wait = MAX_WAIT;
+        if (next) {
+            wait = qMin(wait, static_cast<int>(std::ceil((1 - bucket->tokens) * 1000 / bucket->rate.perSecond)));
+        }
+        if (options.deadline > 0) {
+            wait = qMin(wait, static_cast<int>(options.deadline - now));
+        }
+        mChanged.wait(&mMutex, static_cast<unsigned long>(qMax(wait, 1)));
+        now = QDateTime::currentMSecsSinceEpoch();
+    }
+}
+
+RateLimiter::Stats RateLimiter::stats(Router::Service service) const
+{
+    QMutexLocker locker(&mMutex);
+    Stats stats;
+
+    stats.interactiveWaiting = 0;
+    stats.batchWaiting = 0;
+    stats.granted = mStats.value(service).granted;
+    stats.waitedMsecs = mStats.value(service).waitedMsecs;
+    for (auto bucket : mBuckets) {
+        if (bucket->service == service) {
+            stats.interactiveWaiting += bucket->waiting[RequestOptions::Interactive].size();
+            stats.batchWaiting += bucket->waiting[RequestOptions::Batch].size();
+        }
+    }
+    return stats;
+}
+
+}
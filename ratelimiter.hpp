@@ -0,0 +1,85 @@
+#pragma once
+
+#include <QHash>
+#include <QMutex>
+#include <QQueue>
+#include <QString>
+#include <QWaitCondition>
+#include "requestoptions.hpp"
+#include "router.hpp"
+
+namespace Bing {
+
+/**
+ * Keeps requests within the quota of each subscription key.
+ *
+ * Every key of a service has a token bucket; a request takes a token
+ * before each attempt and waits when the bucket is empty. Waiting
+ * interactive requests are always served before waiting batch requests
+ * of the same key, while batch requests take whatever is left over.
+ */
+class RateLimiter {
+public:
+    struct Stats {
+        int    interactiveWaiting;
+        int    batchWaiting;
+        qint64 granted;
+        qint64 waitedMsecs; // Total time requests spent waiting for a token
+    };
+
+    static RateLimiter *instance();
+
+    /**
+     * Rate of every key of service that has none of its own
+     *
+     * \param perSecond Sustained requests per second, 0 for no limit
+     * \param burst Requests that may be sent at once after an idle period
+     */
+    void setRate(Router::Service service, double perSecond, int burst = 1);
+
+    /**
+     * Rate of one key of service, overriding the service's
+     */
+    void setRate(Router::Service service, const QString &key, double perSecond, int burst = 1);
+
+    /**
+     * Blocks until a request to service with key may be sent. Returns
+     * false without taking a token when the request was cancelled or its
+     * deadline passed in the meantime; the session then aborts it.
+     */
+    bool acquire(Router::Service service, const QString &key, const RequestOptions &options);
+
+    Stats stats(Router::Service service) const;
+
+private:
+    RateLimiter();
+    ~RateLimiter();
+    RateLimiter(const RateLimiter &);
+    RateLimiter &operator=(const RateLimiter &);
+
+    struct Rate {
+        double perSecond;
+        int    burst;
+    };
+
+    struct Bucket {
+        int            service;
+        Rate           rate;
+        double         tokens;
+        qint64         refilled;
+        QQueue<qint64> waiting[2]; // Tickets by RequestOptions::Priority
+    };
+
+    mutable QMutex          mMutex;
+    QWaitCondition          mChanged;
+    QHash<int, Rate>        mServiceRates;
+    QHash<QString, Rate>    mKeyRates;
+    QHash<QString, Bucket *> mBuckets;
+    QHash<int, Stats>       mStats;
+    qint64                  mTickets;
+
+    Rate rateOf(int service, const QString &id) const;
+    void refill(Bucket *bucket, qint64 now);
+};
+
+}
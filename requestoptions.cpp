@@ -0,0 +1,94 @@
+#include "requestoptions.hpp"
+#include "session.hpp"
+
+#include <QDateTime>
+
+namespace Bing {
+
+CancellationToken::CancellationToken() :
+    d(new State)
+{
+    d->cancelled = false;
+}
+
+void CancellationToken::cancel()
+{
+    QMutexLocker locker(&d->mutex);
+
+    if (d->cancelled) {
+        return;
+    }
+    d->cancelled = true;
+
+    // Messages can't detach, and so can't be freed, while they're being cancelled
+    for (auto msg : d->messages) {
+        Session::instance()->cancel(msg);
+    }
+
+    for (auto &weak : d->children) {
+        auto state = weak.toStrongRef();
+        if (state) {
+            CancellationToken child;
+            child.d = state;
+            child.cancel();
+        }
+    }
+}
+
+bool CancellationToken::isCancelled() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->cancelled;
+}
+
+CancellationToken CancellationToken::child() const
+{
+    CancellationToken child;
+    QMutexLocker locker(&d->mutex);
+
+    if (d->cancelled) {
+        child.d->cancelled = true;
+        return child;
+    }
+
+    for (auto i = d->children.size() - 1; i >= 0; i--) {
+        if (d->children[i].isNull()) {
+            d->children.removeAt(i);
+        }
+    }
+    d->children.append(child.d);
+    return child;
+}
+
+bool CancellationToken::attach(SoupMessage *msg) const
+{
+    QMutexLocker locker(&d->mutex);
+
+    if (d->cancelled) {
+        return false;
+    }
+    d->messages.append(msg);
+    return true;
+}
+
+void CancellationToken::detach(SoupMessage *msg) const
+{
+    QMutexLocker locker(&d->mutex);
+    d->messages.removeOne(msg);
+}
+
+RequestOptions::RequestOptions() :
+    deadline(0),
+    priority(Interactive)
+{
+}
+
+RequestOptions RequestOptions::withTimeout(int msecs)
+{
+    RequestOptions options;
+
+    options.deadline = QDateTime::currentMSecsSinceEpoch() + msecs;
+    return options;
+}
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <libsoup/soup.h>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QWeakPointer>
+
+namespace Bing {
+
+/**
+ * Handle a caller keeps to abort the requests it was passed to.
+ *
+ * Copies share the same state, so cancelling any copy cancels every
+ * request made with any of them. Cancelling only aborts those requests;
+ * others sharing the session and its connections carry on.
+ */
+class CancellationToken {
+public:
+    CancellationToken();
+
+    /**
+     * Aborts every request made with the token, now and in the future
+     */
+    void cancel();
+    bool isCancelled() const;
+
+    /**
+     * New token that is cancelled along with this one, but can also be
+     * cancelled on its own
+     */
+    CancellationToken child() const;
+
+private:
+    friend class Session;
+
+    struct State {
+        QMutex                      mutex;
+        bool                        cancelled;
+        QList<SoupMessage *>        messages;
+        QList<QWeakPointer<State> > children;
+    };
+
+    QSharedPointer<State> d;
+
+    /**
+     * Registers msg for cancellation, false if the token is already cancelled
+     */
+    bool attach(SoupMessage *msg) const;
+    void detach(SoupMessage *msg) const;
+};
+
+/**
+ * Per-call controls for a request
+ */
+struct RequestOptions {
+    enum Priority {
+        Interactive = 0, // A caller is waiting on the result
+        Batch,           // Background work, sent with whatever quota interactive requests leave
+    };
+
+    RequestOptions();
+
+    /**
+     * Options whose deadline is msecs from now
+     */
+    static RequestOptions withTimeout(int msecs);
+
+    /**
+     * Milliseconds since the epoch after which the request is aborted
+     * with DeadlineExceededStatus, 0 for none
+     */
+    qint64 deadline;
+
+    CancellationToken token;
+
+    /**
+     * Order in which the request gets a share of its key's rate, see RateLimiter
+     */
+    Priority priority;
+};
+
+}
@@ -0,0 +1,82 @@
+#include "responsebuffer.hpp"
+
+namespace Bing {
+
+static void releaseBytes(gpointer bytes)
+{
+    delete static_cast<QByteArray *>(bytes);
+}
+
+ResponseBuffer::ResponseBuffer() :
+    mBuffer(nullptr)
+{
+}
+
+// The buffer owns a shallow copy of bytes, which keeps the data alive
+ResponseBuffer::ResponseBuffer(const QByteArray &bytes)
+{
+    auto owner = new QByteArray(bytes);
+    mBuffer = soup_buffer_new_with_owner(owner->constData(), owner->size(), owner, releaseBytes);
+}
+
+ResponseBuffer::ResponseBuffer(const ResponseBuffer &other) :
+    mBuffer(other.mBuffer ? soup_buffer_copy(other.mBuffer) : nullptr)
+{
+}
+
+ResponseBuffer &ResponseBuffer::operator=(const ResponseBuffer &other)
+{
+    if (this != &other) {
+        auto buffer = other.mBuffer ? soup_buffer_copy(other.mBuffer) : nullptr;
+        if (mBuffer) {
+            soup_buffer_free(mBuffer);
+        }
+        mBuffer = buffer;
+    }
+    return *this;
+}
+
+ResponseBuffer::~ResponseBuffer()
+{
+    if (mBuffer) {
+        soup_buffer_free(mBuffer);
+    }
+}
+
+// An accumulated body is already flattened once the response is in, so
+// flattening again only takes a reference to libsoup's buffer
+ResponseBuffer ResponseBuffer::take(SoupMessage *msg)
+{
+    ResponseBuffer buffer;
+
+    buffer.mBuffer = soup_message_body_flatten(msg->response_body);
+    g_object_unref(msg);
+    return buffer;
+}
+
+const char *ResponseBuffer::data() const
+{
+    return mBuffer ? mBuffer->data : nullptr;
+}
+
+int ResponseBuffer::size() const
+{
+    return mBuffer ? static_cast<int>(mBuffer->length) : 0;
+}
+
+bool ResponseBuffer::isEmpty() const
+{
+    return size() == 0;
+}
+
+QByteArray ResponseBuffer::bytes() const
+{
+    return QByteArray::fromRawData(data(), size());
+}
+
+QByteArray ResponseBuffer::toByteArray() const
+{
+    return QByteArray(data(), size());
+}
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <libsoup/soup.h>
+#include <QByteArray>
+
+namespace Bing {
+
+/**
+ * Response body that outlives its SoupMessage without being copied.
+ *
+ * The buffer holds a reference to libsoup's own flattened body, so the
+ * message can be released as soon as the response is in. Copies share
+ * the same memory.
+ */
+class ResponseBuffer {
+public:
+    ResponseBuffer();
+
+    /**
+     * Buffer sharing the data of bytes
+     */
+    explicit ResponseBuffer(const QByteArray &bytes);
+    ResponseBuffer(const ResponseBuffer &other);
+    ResponseBuffer &operator=(const ResponseBuffer &other);
+    ~ResponseBuffer();
+
+    /**
+     * Takes the response body of msg and releases msg
+     */
+    static ResponseBuffer take(SoupMessage *msg);
+
+    const char *data() const;
+    int size() const;
+    bool isEmpty() const;
+
+    /**
+     * The data without copying it; only valid while the buffer lives
+     */
+    QByteArray bytes() const;
+
+    /**
+     * Copy of the data that stays valid on its own
+     */
+    QByteArray toByteArray() const;
+
+private:
+    SoupBuffer *mBuffer;
+};
+
+}
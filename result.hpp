@@ -0,0 +1,118 @@
+#pragma once
+
+#include <libsoup/soup.h>
+#include <QElapsedTimer>
+#include <QString>
+#include "exception.hpp"
+#include "retrypolicy.hpp"
+#include "session.hpp"
+
+namespace Bing {
+
+/**
+ * Outcome of a request, returned by the try* methods instead of throwing.
+ *
+ * value is only meaningful when ok(); otherwise error and the response
+ * details say what went wrong and when the request may be retried.
+ */
+template <typename T>
+struct Result {
+    Result() :
+        value(),
+        error(0),
+        status(0),
+        elapsed(0),
+        retryAfter(-1),
+        attempts(0)
+    {
+    }
+
+    T       value;
+    int     error;      // Bing::Error, 0 on success
+    guint   status;     // HTTP status, or libsoup's transport status below 100
+    QString reason;     // Reason phrase of the response or description of the transport error
+    int     elapsed;    // Milliseconds from the first attempt to the final response
+    qint64  retryAfter; // Milliseconds the service asked to wait before retrying, -1 if it didn't
+    int     attempts;   // Attempts made, retries included; 0 when answered from a cache
+
+    bool ok() const
+    {
+        return error == 0;
+    }
+
+    /**
+     * Exception describing the failure, as thrown by the throwing methods
+     */
+    Exception exception() const
+    {
+        return Exception(static_cast<Error>(error), status);
+    }
+
+    /**
+     * The value, throwing exception() if the request failed
+     */
+    const T &get() const
+    {
+        if (!ok()) {
+            throw exception();
+        }
+        return value;
+    }
+
+    /**
+     * Result of another type with the same outcome and details
+     */
+    template <typename U>
+    Result<U> withValue(const U &other) const
+    {
+        Result<U> result;
+
+        result.value = other;
+        result.error = error;
+        result.status = status;
+        result.reason = reason;
+        result.elapsed = elapsed;
+        result.retryAfter = retryAfter;
+        result.attempts = attempts;
+        return result;
+    }
+
+    /**
+     * Fills in the details of msg, which completed with status
+     */
+    void setResponse(SoupMessage *msg, guint httpStatusCode, const QElapsedTimer &timer)
+    {
+        status = httpStatusCode;
+        error = Exception::errorOf(httpStatusCode);
+        reason = QString::fromUtf8(msg->reason_phrase ? msg->reason_phrase : soup_status_get_phrase(httpStatusCode));
+        elapsed = static_cast<int>(timer.elapsed());
+        retryAfter = RetryPolicy::retryAfter(msg);
+        attempts = Session::attempts(msg);
+    }
+
+    /**
+     * Failure that happened before or without a response
+     */
+    static Result failure(Error error, const QString &reason = QString())
+    {
+        Result result;
+
+        result.error = error;
+        result.reason = reason;
+        return result;
+    }
+
+    /**
+     * Success that didn't need a request, e.g. an answer from a cache
+     */
+    static Result cached(const T &value)
+    {
+        Result result;
+
+        result.value = value;
+        result.status = SOUP_STATUS_OK;
+        return result;
+    }
+};
+
+}
@@ -0,0 +1,152 @@
+#include "retrypolicy.hpp"
+
+#include <QDateTime>
+#include <random>
+
+namespace Bing {
+
+const int DEFAULT_MAX_ATTEMPTS    = 4;
+const int DEFAULT_BASE_DELAY      = 100;       // Milliseconds
+const int DEFAULT_MAX_DELAY       = 10 * 1000; // Milliseconds
+const int DEFAULT_MAX_RETRY_AFTER = 30 * 1000; // Milliseconds
+const double DEFAULT_BUDGET_RATIO = 0.2;       // Retries per request
+const int BUDGET_WINDOW           = 10 * 1000; // Milliseconds covered by the budget
+const guint STATUS_TOO_MANY_REQUESTS = 429;
+
+RetryPolicy::RetryPolicy() :
+    mMaxAttempts(DEFAULT_MAX_ATTEMPTS),
+    mBaseDelay(DEFAULT_BASE_DELAY),
+    mMaxDelay(DEFAULT_MAX_DELAY),
+    mMaxRetryAfter(DEFAULT_MAX_RETRY_AFTER),
+    mBudgetRatio(DEFAULT_BUDGET_RATIO),
+    mBudgetMinPerSecond(1)
+{
+}
+
+void RetryPolicy::setMaxAttempts(int attempts)
+{
+    QMutexLocker locker(&mMutex);
+    mMaxAttempts = qMax(attempts, 1);
+}
+
+int RetryPolicy::maxAttempts() const
+{
+    QMutexLocker locker(&mMutex);
+    return mMaxAttempts;
+}
+
+void RetryPolicy::setBackoff(int baseDelay, int maxDelay)
+{
+    QMutexLocker locker(&mMutex);
+    mBaseDelay = baseDelay;
+    mMaxDelay = maxDelay;
+}
+
+void RetryPolicy::setMaxRetryAfter(int msecs)
+{
+    QMutexLocker locker(&mMutex);
+    mMaxRetryAfter = msecs;
+}
+
+void RetryPolicy::setBudget(double ratio, int minPerSecond)
+{
+    QMutexLocker locker(&mMutex);
+    mBudgetRatio = ratio;
+    mBudgetMinPerSecond = minPerSecond;
+}
+
+bool RetryPolicy::isTransient(guint status) const
+{
+    switch (status) {
+    case SOUP_STATUS_CANT_RESOLVE:
+    case SOUP_STATUS_CANT_CONNECT:
+    case SOUP_STATUS_IO_ERROR:
+    case SOUP_STATUS_REQUEST_TIMEOUT:
+    case STATUS_TOO_MANY_REQUESTS:
+    case SOUP_STATUS_INTERNAL_SERVER_ERROR:
+    case SOUP_STATUS_BAD_GATEWAY:
+    case SOUP_STATUS_SERVICE_UNAVAILABLE:
+    case SOUP_STATUS_GATEWAY_TIMEOUT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+int RetryPolicy::delay(SoupMessage *msg, int attempt)
+{
+    static thread_local std::mt19937 generator(std::random_device{}());
+
+    mMutex.lock();
+    auto ceiling = qMin(static_cast<qint64>(mBaseDelay) << qMin(attempt, 20), static_cast<qint64>(mMaxDelay));
+    auto maxRetryAfter = mMaxRetryAfter;
+    mMutex.unlock();
+
+    // Full jitter spreads retries of clients that failed together
+    std::uniform_int_distribution<qint64> distribution(0, qMax(ceiling, static_cast<qint64>(0)));
+    auto msecs = distribution(generator);
+
+    auto wait = retryAfter(msg);
+    if (wait > maxRetryAfter) {
+        return -1;
+    }
+    return static_cast<int>(qMax(msecs, wait));
+}
+
+void RetryPolicy::deposit()
+{
+    QMutexLocker locker(&mMutex);
+    auto now = QDateTime::currentMSecsSinceEpoch();
+
+    prune(now);
+    mRequests.enqueue(now);
+}
+
+bool RetryPolicy::withdraw()
+{
+    QMutexLocker locker(&mMutex);
+    auto now = QDateTime::currentMSecsSinceEpoch();
+
+    prune(now);
+    auto allowed = mBudgetRatio * mRequests.size() + mBudgetMinPerSecond * (BUDGET_WINDOW / 1000);
+    if (mRetries.size() >= allowed) {
+        return false;
+    }
+    mRetries.enqueue(now);
+    return true;
+}
+
+qint64 RetryPolicy::retryAfter(SoupMessage *msg)
+{
+    auto header = soup_message_headers_get_one(msg->response_headers, "Retry-After");
+    if (!header) {
+        return -1;
+    }
+
+    // Either a number of seconds or an HTTP date
+    bool ok;
+    auto secs = QByteArray(header).trimmed().toLongLong(&ok);
+    if (ok) {
+        return qMax(secs, static_cast<qint64>(0)) * 1000;
+    }
+
+    auto date = soup_date_new_from_string(header);
+    if (!date) {
+        return -1;
+    }
+    auto msecs = static_cast<qint64>(soup_date_to_time_t(date)) * 1000 - QDateTime::currentMSecsSinceEpoch();
+    soup_date_free(date);
+    return qMax(msecs, static_cast<qint64>(0));
+}
+
+void RetryPolicy::prune(qint64 now)
+{
+    while (!mRequests.isEmpty() && mRequests.head() <= now - BUDGET_WINDOW) {
+        mRequests.dequeue();
+    }
+    while (!mRetries.isEmpty() && mRetries.head() <= now - BUDGET_WINDOW) {
+        mRetries.dequeue();
+    }
+}
+
+}
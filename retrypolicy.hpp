@@ -0,0 +1,84 @@
+#pragma once
+
+#include <libsoup/soup.h>
+#include <QMutex>
+#include <QQueue>
+
+namespace Bing {
+
+/**
+ * Decides whether and when a failed request is sent again.
+ *
+ * Transient failures are retried with exponential backoff and full jitter,
+ * never sooner than the service's Retry-After. Retries are capped by a
+ * budget relative to the number of requests, so a throttled service sees
+ * at most a fixed share of extra load.
+ */
+class RetryPolicy {
+public:
+    RetryPolicy();
+
+    /**
+     * Total number of attempts per request, 1 to disable retries
+     */
+    void setMaxAttempts(int attempts);
+    int maxAttempts() const;
+
+    /**
+     * Backoff bounds in milliseconds; the delay before attempt n is drawn
+     * uniformly from [0, min(maxDelay, baseDelay * 2^n)]
+     */
+    void setBackoff(int baseDelay, int maxDelay);
+
+    /**
+     * Longest Retry-After in milliseconds that is waited out, longer ones
+     * give up right away
+     */
+    void setMaxRetryAfter(int msecs);
+
+    /**
+     * Retry budget: retries may not exceed ratio times the requests made
+     * over the last ten seconds, plus minPerSecond retries per second
+     */
+    void setBudget(double ratio, int minPerSecond = 1);
+
+    /**
+     * Whether a request that ended with status is worth sending again
+     */
+    bool isTransient(guint status) const;
+
+    /**
+     * Milliseconds to wait before attempt + 1 of msg, or -1 to give up
+     */
+    int delay(SoupMessage *msg, int attempt);
+
+    /**
+     * Records a first attempt, earning budget for later retries
+     */
+    void deposit();
+
+    /**
+     * Takes one retry from the budget, false if it's exhausted
+     */
+    bool withdraw();
+
+    /**
+     * Milliseconds the response in msg asks the client to wait, -1 if none
+     */
+    static qint64 retryAfter(SoupMessage *msg);
+
+private:
+    mutable QMutex mMutex;
+    int            mMaxAttempts;
+    int            mBaseDelay;
+    int            mMaxDelay;
+    int            mMaxRetryAfter;
+    double         mBudgetRatio;
+    int            mBudgetMinPerSecond;
+    QQueue<qint64> mRequests;
+    QQueue<qint64> mRetries;
+
+    void prune(qint64 now);
+};
+
+}
@@ -0,0 +1,96 @@
+#include "ringbuffer.hpp"
+
+#include <cstring>
+
+namespace Bing {
+
+AudioRingBuffer::AudioRingBuffer(int capacity, OverrunPolicy policy) :
+    mData(new char[qMax(capacity, 1)]),
+    mCapacity(qMax(capacity, 1)),
+    mPolicy(policy),
+    mClosed(false),
+    mDropped(0),
+    mReadPos(0),
+    mWritePos(0)
+{
+}
+
+AudioRingBuffer::~AudioRingBuffer()
+{
+    delete[] mData;
+}
+
+int AudioRingBuffer::write(const char *data, int size)
+{
+    auto writePos = mWritePos.load(std::memory_order_relaxed);
+    auto readPos = mReadPos.load(std::memory_order_acquire);
+    int space = mCapacity - static_cast<int>(writePos - readPos);
+    int count = size;
+
+    if (count > space) {
+        count = mPolicy == DropNewest ? space : 0;
+        mDropped.fetch_add(size - count, std::memory_order_relaxed);
+        if (count == 0) {
+            return 0;
+        }
+    }
+
+    int offset = writePos % mCapacity;
+    int first = qMin(count, mCapacity - offset);
+    memcpy(mData + offset, data, first);
+    memcpy(mData, data + first, count - first);
+    mWritePos.store(writePos + count, std::memory_order_release);
+
+    return count;
+}
+
+void AudioRingBuffer::close()
+{
+    mClosed.store(true, std::memory_order_release);
+}
+
+int AudioRingBuffer::read(char *data, int size)
+{
+    auto readPos = mReadPos.load(std::memory_order_relaxed);
+    auto writePos = mWritePos.load(std::memory_order_acquire);
+    int count = qMin(size, static_cast<int>(writePos - readPos));
+
+    if (count <= 0) {
+        return 0;
+    }
+
+    int offset = readPos % mCapacity;
+    int first = qMin(count, mCapacity - offset);
+    memcpy(data, mData + offset, first);
+    memcpy(data + first, mData, count - first);
+    mReadPos.store(readPos + count, std::memory_order_release);
+
+    return count;
+}
+
+bool AudioRingBuffer::atEnd() const
+{
+    return mClosed.load(std::memory_order_acquire) && available() == 0;
+}
+
+int AudioRingBuffer::capacity() const
+{
+    return mCapacity;
+}
+
+int AudioRingBuffer::available() const
+{
+    return static_cast<int>(mWritePos.load(std::memory_order_acquire) - mReadPos.load(std::memory_order_acquire));
+}
+
+int AudioRingBuffer::space() const
+{
+    return mCapacity - available();
+}
+
+qint64 AudioRingBuffer::dropped() const
+{
+    return mDropped.load(std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <QtGlobal>
+
+namespace Bing {
+
+/**
+ * Lock-free single-producer/single-consumer ring buffer for PCM audio.
+ *
+ * The capture thread writes and one uploader thread reads. Storage is
+ * allocated once up front and neither side ever blocks or allocates.
+ */
+class AudioRingBuffer {
+public:
+    enum OverrunPolicy {
+        DropFrame = 0, // Drop a frame that doesn't fit entirely
+        DropNewest,    // Write the part of a frame that fits and drop the rest
+    };
+
+    /**
+     * Constructor
+     *
+     * \param capacity Size of the preallocated storage in bytes, at least 1
+     * \param policy What to do with audio written while the buffer is full
+     */
+    AudioRingBuffer(int capacity, OverrunPolicy policy = DropFrame);
+    ~AudioRingBuffer();
+
+    /**
+     * Producer side. Returns the number of bytes accepted.
+     */
+    int write(const char *data, int size);
+
+    /**
+     * Producer side. Marks the end of the stream.
+     */
+    void close();
+
+    /**
+     * Consumer side. Returns the number of bytes read, 0 if none is available.
+     */
+    int read(char *data, int size);
+
+    /**
+     * Whether the stream is closed and every byte has been read
+     */
+    bool atEnd() const;
+
+    int capacity() const;
+    int available() const;
+    int space() const;
+
+    /**
+     * Number of bytes dropped because the buffer was full
+     */
+    qint64 dropped() const;
+
+private:
+    AudioRingBuffer(const AudioRingBuffer &);
+    AudioRingBuffer &operator=(const AudioRingBuffer &);
+
+    char *              mData;
+    int                 mCapacity;
+    OverrunPolicy       mPolicy;
+    std::atomic<bool>   mClosed;
+    std::atomic<qint64> mDropped;
+
+    // Monotonic positions, kept on separate cache lines
+    alignas(64) std::atomic<quint64> mReadPos;
+    alignas(64) std::atomic<quint64> mWritePos;
+};
+
+}
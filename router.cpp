@@ -0,0 +1,216 @@
+#include "router.hpp"
+#include "circuitbreaker.hpp"
+#include "exception.hpp"
+
+#include <memory>
+#include <random>
+
+namespace Bing {
+
+const double DEFAULT_EXPLORATION = 0.05;
+const double SMOOTHING           = 0.2;  // Weight of the newest sample in the moving averages
+const double ERROR_PENALTY       = 10;   // Latency multiplier at a 100% error rate
+const double DEFAULT_LATENCY     = 1000; // Milliseconds assumed before any endpoint of a service has succeeded
+
+static QString baseUrlOf(SoupURI *uri)
+{
+    auto base = soup_uri_copy_host(uri);
+    auto str = soup_uri_to_string(base, FALSE);
+    QString baseUrl = QString(str);
+
+    g_free(str);
+    soup_uri_free(base);
+    if (baseUrl.endsWith('/')) {
+        baseUrl.chop(1);
+    }
+    return baseUrl;
+}
+
+// Points msg at baseUrl, keeping its path and query
+static void rebase(SoupMessage *msg, const QString &baseUrl)
+{
+    auto base = soup_uri_new(baseUrl.toUtf8().data());
+    if (!base) {
+        return;
+    }
+
+    auto uri = soup_uri_copy(soup_message_get_uri(msg));
+    soup_uri_set_scheme(uri, base->scheme);
+    soup_uri_set_host(uri, base->host);
+    soup_uri_set_port(uri, base->port);
+    soup_message_set_uri(msg, uri);
+    soup_uri_free(uri);
+    soup_uri_free(base);
+}
+
+Router *Router::instance()
+{
+    static Router router;
+    return &router;
+}
+
+Router::Router() :
+    mExploration(DEFAULT_EXPLORATION)
+{
+    mEndpoints[RecognitionService] = QStringList() << "https://speech.platform.bing.com";
+    mEndpoints[CustomRecognitionService] = QStringList() << "https://westus.stt.speech.microsoft.com";
+    mEndpoints[SynthesisService] = QStringList() << "https://speech.platform.bing.com";
+    mEndpoints[QnaMakerService] = QStringList() << "https://westus.api.cognitive.microsoft.com";
+    mEndpoints[PredictionService] = QStringList() << "https://southcentralus.api.cognitive.microsoft.com";
+}
+
+void Router::setEndpoints(Service service, const QStringList &baseUrls)
+{
+    QMutexLocker locker(&mMutex);
+    QStringList endpoints;
+
+    for (auto baseUrl : baseUrls) {
+        while (baseUrl.endsWith('/')) {
+            baseUrl.chop(1);
+        }
+        endpoints.append(baseUrl);
+    }
+    mEndpoints[service] = endpoints;
+}
+
+QStringList Router::endpoints(Service service) const
+{
+    QMutexLocker locker(&mMutex);
+    return mEndpoints.value(service);
+}
+
+void Router::setExploration(double share)
+{
+    QMutexLocker locker(&mMutex);
+    mExploration = share;
+}
+
+QString Router::select(Service service, const QStringList &exclude)
+{
+    static thread_local std::mt19937 generator(std::random_device{}());
+    std::uniform_real_distribution<double> chance(0, 1);
+    QStringList candidates;
+    QStringList open;
+
+    for (auto &baseUrl : endpoints(service)) {
+        if (exclude.contains(baseUrl)) {
+            continue;
+        }
+        if (Session::instance()->circuitState(baseUrl) == CircuitBreaker::Open) {
+            open.append(baseUrl);
+        } else {
+            candidates.append(baseUrl);
+        }
+    }
+
+    // With every endpoint down, the first one gets the request and fails fast
+    if (candidates.isEmpty()) {
+        return open.isEmpty() ? QString() : open.first();
+    }
+
+    QMutexLocker locker(&mMutex);
+    if (candidates.size() > 1 && chance(generator) < mExploration) {
+        std::uniform_int_distribution<int> pick(0, candidates.size() - 1);
+        return candidates[pick(generator)];
+    }
+
+    // Endpoints without a successful request are assumed as slow as the
+    // slowest one that has one
+    double worst = 0;
+    for (auto &baseUrl : candidates) {
+        auto measurement = mMeasurements.value(Session::hostOf(baseUrl));
+        if (measurement.successes > 0) {
+            worst = qMax(worst, measurement.latency);
+        }
+    }
+    if (worst <= 0) {
+        worst = DEFAULT_LATENCY;
+    }
+
+    auto best = candidates.first();
+    auto bestScore = score(best, worst);
+    for (auto &baseUrl : candidates) {
+        auto candidateScore = score(baseUrl, worst);
+        if (candidateScore < bestScore) {
+            best = baseUrl;
+            bestScore = candidateScore;
+        }
+    }
+    return best;
+}
+
+Session::Prepare Router::route(Service service, const Session::Prepare &prepare)
+{
+    auto tried = std::make_shared<QStringList>();
+
+    return [this, service, prepare, tried](SoupMessage *msg, int attempt) {
+        if (attempt > 0) {
+            auto current = baseUrlOf(soup_message_get_uri(msg));
+            tried->append(current);
+
+            auto next = select(service, *tried);
+            if (next.isEmpty()) {
+                tried->clear();
+                next = select(service);
+            }
+            if (!next.isEmpty() && next != current) {
+                rebase(msg, next);
+            }
+        }
+
+        if (prepare) {
+            prepare(msg, attempt);
+        }
+    };
+}
+
+void Router::report(const QString &host, guint status, int msecs)
+{
+    if (status == SOUP_STATUS_CANCELLED || status == DeadlineExceededStatus || status == CircuitOpenStatus) {
+        return;
+    }
+
+    QMutexLocker locker(&mMutex);
+    auto &measurement = mMeasurements[host];
+    auto failed = CircuitBreaker::isFailure(status);
+
+    measurement.errorRate = measurement.requests > 0 ? (1 - SMOOTHING) * measurement.errorRate + SMOOTHING * (failed ? 1 : 0) : (failed ? 1 : 0);
+    measurement.requests++;
+    if (!failed) {
+        measurement.latency = measurement.successes > 0 ? (1 - SMOOTHING) * measurement.latency + SMOOTHING * msecs : msecs;
+        measurement.successes++;
+    }
+}
+
+QList<Router::Endpoint> Router::stats(Service service) const
+{
+    QMutexLocker locker(&mMutex);
+    QList<Endpoint> stats;
+
+    for (auto &baseUrl : mEndpoints.value(service)) {
+        auto measurement = mMeasurements.value(Session::hostOf(baseUrl));
+        Endpoint endpoint;
+        endpoint.baseUrl = baseUrl;
+        endpoint.latency = measurement.latency;
+        endpoint.errorRate = measurement.errorRate;
+        endpoint.requests = measurement.requests;
+        stats.append(endpoint);
+    }
+    return stats;
+}
+
+// Lower is better. An endpoint that fails fast, e.g. with CANT_CONNECT,
+// has no latency of its own, so it's scored at the worst latency and the
+// full error penalty rather than looking like the fastest one. Unmeasured
+// endpoints get measured through exploration.
+double Router::score(const QString &baseUrl, double worstLatency) const
+{
+    auto measurement = mMeasurements.value(Session::hostOf(baseUrl));
+
+    if (measurement.requests == 0) {
+        return worstLatency;
+    }
+    return (measurement.successes > 0 ? measurement.latency : worstLatency) * (1 + ERROR_PENALTY * measurement.errorRate);
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <libsoup/soup.h>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QStringList>
+#include "session.hpp"
+
+namespace Bing {
+
+/**
+ * Picks the regional endpoint each request goes to.
+ *
+ * Every service has a list of interchangeable base URLs, e.g. the same
+ * resource deployed in several regions. Requests go to the endpoint with
+ * the lowest latency, weighted by its error rate; a small share explores
+ * the others so their measurements stay current. Endpoints whose circuit
+ * breaker is open are skipped, and a request that fails moves on to the
+ * next best endpoint when it's retried.
+ *
+ * The endpoints of one service must accept the same credentials.
+ */
+class Router {
+public:
+    enum Service {
+        RecognitionService = 0,
+        CustomRecognitionService,
+        SynthesisService,
+        QnaMakerService,
+        PredictionService,
+    };
+
+    struct Endpoint {
+        QString baseUrl;
+        double  latency;   // Moving average in milliseconds of successful requests
+        double  errorRate; // Moving average of failed requests
+        qint64  requests;
+    };
+
+    static Router *instance();
+
+    /**
+     * Base URLs, e.g. "https://westus.api.cognitive.microsoft.com", of service
+     */
+    void setEndpoints(Service service, const QStringList &baseUrls);
+    QStringList endpoints(Service service) const;
+
+    /**
+     * Share of requests sent to an endpoint other than the best one
+     */
+    void setExploration(double share);
+
+    /**
+     * Best base URL for the next request to service, skipping exclude
+     */
+    QString select(Service service, const QStringList &exclude = QStringList());
+
+    /**
+     * Wraps prepare so retries of a request to service fail over to the
+     * next best endpoint
+     */
+    Session::Prepare route(Service service, const Session::Prepare &prepare = Session::Prepare());
+
+    /**
+     * Outcome of a request to host, see Session::hostOf(); fed by the session
+     */
+    void report(const QString &host, guint status, int msecs);
+
+    QList<Endpoint> stats(Service service) const;
+
+private:
+    Router();
+    Router(const Router &);
+    Router &operator=(const Router &);
+
+    struct Measurement {
+        double latency;
+        double errorRate;
+        qint64 requests;
+        qint64 successes;
+    };
+
+    mutable QMutex                  mMutex;
+    QHash<int, QStringList>         mEndpoints;
+    QHash<QString, Measurement>     mMeasurements;
+    double                          mExploration;
+
+    double score(const QString &baseUrl, double worstLatency) const;
+};
+
+}
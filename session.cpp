@@ -0,0 +1,762 @@
+#include "session.hpp"
+#include "exception.hpp"
+#include "router.hpp"
+
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QThread>
+#include <algorithm>
+#include <memory>
+#include <QtConcurrent>
+
+namespace Bing {
+
+const int DEFAULT_MAX_CONNECTIONS          = 64;
+const int DEFAULT_MAX_CONNECTIONS_PER_HOST = 16;
+const int DEFAULT_IDLE_TIMEOUT             = 60; // Seconds an unused connection is kept alive
+const int WARM_POOL_THREADS                = 16; // Concurrent connection attempts when prewarming
+const int HEDGE_POOL_THREADS               = 64; // Concurrent hedged requests
+const double DEFAULT_HEDGE_PERCENTILE      = 0.95;
+const double DEFAULT_HEDGE_BUDGET          = 0.05;
+const int LATENCY_SAMPLES                  = 512;       // Latencies kept per host
+const int MIN_LATENCY_SAMPLES              = 20;        // Latencies needed before hedging a host
+const int HEDGE_WINDOW                     = 10 * 1000; // Milliseconds covered by the hedge budget
+const double DEFAULT_BREAKER_FAILURE_RATE  = 0.5;
+const int DEFAULT_BREAKER_MIN_REQUESTS     = 10;
+const int DEFAULT_BREAKER_SLOW_CALL        = 10 * 1000; // Milliseconds
+const int DEFAULT_BREAKER_OPEN_DURATION    = 5 * 1000;  // Milliseconds
+const int DEFAULT_LIMIT_MINIMUM            = 1;
+const double DEFAULT_LIMIT_TOLERANCE       = 2.0;
+const char *ATTEMPTS_KEY                   = "bing-attempts";
+const int SLOT_WAIT                        = 50; // Milliseconds between checks for cancellation while waiting for a slot
+
+static void appendHeader(const char *name, const char *value, gpointer headers)
+{
+    soup_message_headers_append(static_cast<SoupMessageHeaders *>(headers), name, value);
+}
+
+// Copy of a request that hasn't been sent yet, pointed at alternate if given
+static SoupMessage *duplicate(SoupMessage *msg, const QString &alternate)
+{
+    auto uri = soup_uri_copy(soup_message_get_uri(msg));
+    if (!alternate.isEmpty()) {
+        auto base = soup_uri_new(alternate.toUtf8().data());
+        if (base) {
+            soup_uri_set_scheme(uri, base->scheme);
+            soup_uri_set_host(uri, base->host);
+            soup_uri_set_port(uri, base->port);
+            soup_uri_free(base);
+        }
+    }
+
+    auto copy = soup_message_new_from_uri(msg->method, uri);
+    soup_uri_free(uri);
+    soup_message_headers_foreach(msg->request_headers, appendHeader, copy->request_headers);
+
+    // Both requests share the one flattened body
+    auto body = soup_message_body_flatten(msg->request_body);
+    soup_message_body_append_buffer(copy->request_body, body);
+    soup_buffer_free(body);
+
+    return copy;
+}
+
+// Moves the response of from into to
+static void adopt(SoupMessage *to, SoupMessage *from)
+{
+    soup_message_set_status_full(to, from->status_code, from->reason_phrase);
+    soup_message_headers_clear(to->response_headers);
+    soup_message_headers_foreach(from->response_headers, appendHeader, to->response_headers);
+    soup_message_body_truncate(to->response_body);
+
+    auto body = soup_message_body_flatten(from->response_body);
+    soup_message_body_append_buffer(to->response_body, body);
+    soup_buffer_free(body);
+    g_object_set_data(G_OBJECT(to), ATTEMPTS_KEY, g_object_get_data(G_OBJECT(from), ATTEMPTS_KEY));
+}
+
+double Session::Stats::utilization() const
+{
+    return maxConnections > 0 ? static_cast<double>(inFlight) / maxConnections : 0;
+}
+
+Session *Session::instance()
+{
+    static Session session;
+    return &session;
+}
+
+QString Session::hostOf(SoupURI *uri)
+{
+    if (soup_uri_uses_default_port(uri)) {
+        return uri->host;
+    }
+    return QString("%1:%2").arg(uri->host).arg(uri->port);
+}
+
+QString Session::hostOf(const QString &url)
+{
+    QString host = url;
+    auto uri = soup_uri_new(url.toUtf8().data());
+
+    if (uri) {
+        host = hostOf(uri);
+        soup_uri_free(uri);
+    }
+    return host;
+}
+
+Session::Session() :
+    mLogLevel(-1),
+    mMaxConnections(DEFAULT_MAX_CONNECTIONS),
+    mMaxConnectionsPerHost(DEFAULT_MAX_CONNECTIONS_PER_HOST),
+    mInFlight(0),
+    mPeakInFlight(0),
+    mRequests(0),
+    mRetries(0),
+    mHedgePercentile(DEFAULT_HEDGE_PERCENTILE),
+    mHedgeBudget(DEFAULT_HEDGE_BUDGET),
+    mBreakerFailureRate(DEFAULT_BREAKER_FAILURE_RATE),
+    mBreakerMinRequests(DEFAULT_BREAKER_MIN_REQUESTS),
+    mBreakerSlowCall(DEFAULT_BREAKER_SLOW_CALL),
+    mBreakerOpenDuration(DEFAULT_BREAKER_OPEN_DURATION),
+    mLimitInitial(DEFAULT_MAX_CONNECTIONS_PER_HOST),
+    mLimitMinimum(DEFAULT_LIMIT_MINIMUM),
+    mLimitMaximum(DEFAULT_MAX_CONNECTIONS_PER_HOST),
+    mLimitTolerance(DEFAULT_LIMIT_TOLERANCE),
+    mHedges(0),
+    mHedgeWins(0),
+    mKeepWarmConnections(0),
+    mKeepWarmInterval(0),
+    mStopping(false)
+{
+    mWarmPool.setMaxThreadCount(WARM_POOL_THREADS);
+    mHedgePool.setMaxThreadCount(HEDGE_POOL_THREADS);
+    mSession = soup_session_new_with_options(
+        SOUP_SESSION_ADD_FEATURE_BY_TYPE, SOUP_TYPE_CONTENT_SNIFFER,
+        SOUP_SESSION_MAX_CONNS, mMaxConnections,
+        SOUP_SESSION_MAX_CONNS_PER_HOST, mMaxConnectionsPerHost,
+        SOUP_SESSION_IDLE_TIMEOUT, DEFAULT_IDLE_TIMEOUT,
+        NULL);
+    g_signal_connect(mSession, "request-queued", G_CALLBACK(&Session::queued), this);
+    enableLogging(0);
+}
+
+Session::~Session()
+{
+    mMutex.lock();
+    mStopping = true;
+    mKeepWarmChanged.wakeAll();
+    mDeadlinesChanged.wakeAll();
+    mMutex.unlock();
+
+    if (mKeepWarmThread.joinable()) {
+        mKeepWarmThread.join();
+    }
+    if (mWatchdogThread.joinable()) {
+        mWatchdogThread.join();
+    }
+    mWarmPool.waitForDone();
+    mHedgePool.waitForDone();
+    qDeleteAll(mBreakers);
+    qDeleteAll(mLimiters);
+    g_object_unref(mSession);
+}
+
+SoupSession *Session::soup() const
+{
+    return mSession;
+}
+
+void Session::enableLogging(int log)
+{
+    SoupLogger *logger;
+    SoupLoggerLogLevel logLevel;
+
+    QMutexLocker locker(&mMutex);
+    if (log <= mLogLevel) {
+        return;
+    }
+    mLogLevel = log;
+
+    if (log <= 0) {
+        logLevel = SOUP_LOGGER_LOG_NONE;
+    } else if (log == 1) {
+        logLevel = SOUP_LOGGER_LOG_MINIMAL;
+    } else if (log == 2) {
+        logLevel = SOUP_LOGGER_LOG_HEADERS;
+    } else {
+        logLevel = SOUP_LOGGER_LOG_BODY;
+    }
+
+    soup_session_remove_feature_by_type(mSession, SOUP_TYPE_LOGGER);
+    logger = soup_logger_new(logLevel, -1);
+    soup_session_add_feature(mSession, SOUP_SESSION_FEATURE(logger));
+    g_object_unref(logger);
+}
+
+void Session::setMaxConnections(int total, int perHost)
+{
+    QMutexLocker locker(&mMutex);
+
+    mMaxConnections = total;
+    mMaxConnectionsPerHost = perHost;
+    g_object_set(mSession, SOUP_SESSION_MAX_CONNS, total, SOUP_SESSION_MAX_CONNS_PER_HOST, perHost, NULL);
+    for (auto limiter : mLimiters) {
+        configureLimiter(limiter);
+    }
+}
+
+void Session::prewarm(const QStringList &urls, int connections, bool wait)
+{
+    QStringList baseUrls;
+
+    for (auto &url : urls) {
+        auto uri = soup_uri_new(url.toUtf8().data());
+        if (!uri) {
+            continue;
+        }
+
+        auto baseUrl = QString("%1://%2:%3").arg(uri->scheme).arg(uri->host).arg(uri->port);
+        mMutex.lock();
+        mWarmHosts.insert(hostOf(uri), baseUrl);
+        mMutex.unlock();
+        if (!baseUrls.contains(baseUrl)) {
+            baseUrls.append(baseUrl);
+        }
+        soup_uri_free(uri);
+    }
+
+    for (auto &baseUrl : baseUrls) {
+        connect(baseUrl, connections);
+    }
+
+    if (wait) {
+        mWarmPool.waitForDone();
+    }
+}
+
+void Session::setKeepWarm(int connections, int intervalSecs)
+{
+    QMutexLocker locker(&mMutex);
+
+    mKeepWarmConnections = connections;
+    // A zero interval would count every host as idle and ping them nonstop
+    mKeepWarmInterval = qMax(intervalSecs, 1);
+    mKeepWarmChanged.wakeAll();
+    if (connections > 0 && !mKeepWarmThread.joinable()) {
+        mKeepWarmThread = std::thread(&Session::keepWarm, this);
+    }
+}
+
+// Opens connections by sending concurrent HEAD requests; libsoup keeps
+// them alive in the pool once the responses are read
+void Session::connect(const QString &baseUrl, int connections)
+{
+    auto session = mSession;
+
+    for (auto i = 0; i < connections; i++) {
+        QtConcurrent::run(&mWarmPool, [session, baseUrl]() {
+            auto msg = soup_message_new("HEAD", (baseUrl + "/").toUtf8().data());
+            if (msg) {
+                soup_session_send_message(session, msg);
+                g_object_unref(msg);
+            }
+        });
+    }
+}
+
+void Session::keepWarm()
+{
+    QMutexLocker locker(&mMutex);
+
+    while (!mStopping) {
+        if (mKeepWarmConnections <= 0) {
+            mKeepWarmChanged.wait(&mMutex);
+            continue;
+        }
+
+        auto interval = mKeepWarmInterval * 1000;
+        mKeepWarmChanged.wait(&mMutex, interval);
+        if (mStopping || mKeepWarmConnections <= 0) {
+            continue;
+        }
+
+        // Only hosts that have been idle for a whole interval need pinging
+        auto now = QDateTime::currentMSecsSinceEpoch();
+        QStringList idle;
+        for (auto it = mWarmHosts.constBegin(); it != mWarmHosts.constEnd(); ++it) {
+            if (now - mLastActivity.value(it.key()) >= interval) {
+                idle.append(it.value());
+            }
+        }
+
+        auto connections = mKeepWarmConnections;
+        locker.unlock();
+        for (auto &baseUrl : idle) {
+            connect(baseUrl, connections);
+        }
+        locker.relock();
+    }
+}
+
+void Session::setTimeout(unsigned int secs)
+{
+    g_object_set(mSession, SOUP_SESSION_TIMEOUT, secs, NULL);
+}
+
+void Session::setIdleTimeout(unsigned int secs)
+{
+    g_object_set(mSession, SOUP_SESSION_IDLE_TIMEOUT, secs, NULL);
+}
+
+RetryPolicy *Session::retryPolicy()
+{
+    return &mRetryPolicy;
+}
+
+guint Session::send(SoupMessage *msg, const Prepare &prepare, bool retryable, const RequestOptions &options)
+{
+    auto maxAttempts = retryable ? mRetryPolicy.maxAttempts() : 1;
+    guint httpStatusCode = 0;
+
+    activate(msg);
+    if (!options.token.attach(msg)) {
+        cancel(msg);
+    }
+    if (options.deadline > 0) {
+        QMutexLocker locker(&mMutex);
+        mDeadlines.insert(options.deadline, msg);
+        mDeadlinesChanged.wakeAll();
+        if (!mWatchdogThread.joinable()) {
+            mWatchdogThread = std::thread(&Session::watchdog, this);
+        }
+    }
+
+    mRetryPolicy.deposit();
+    for (auto attempt = 0; attempt < maxAttempts; attempt++) {
+        if (attempt > 0) {
+            auto msecs = mRetryPolicy.delay(msg, attempt - 1);
+            if (options.deadline > 0 && QDateTime::currentMSecsSinceEpoch() + msecs >= options.deadline) {
+                break;
+            }
+            if (msecs < 0 || !mRetryPolicy.withdraw()) {
+                break;
+            }
+
+            // Back off, unless the request gets cancelled in the meantime
+            QMutexLocker locker(&mMutex);
+            auto until = QDateTime::currentMSecsSinceEpoch() + msecs;
+            auto now = QDateTime::currentMSecsSinceEpoch();
+            while (!mCancelled.contains(msg) && now < until) {
+                mCancelledChanged.wait(&mMutex, until - now);
+                now = QDateTime::currentMSecsSinceEpoch();
+            }
+            mRetries++;
+        }
+
+        if (prepare) {
+            prepare(msg, attempt);
+        }
+        g_object_set_data(G_OBJECT(msg), ATTEMPTS_KEY, GINT_TO_POINTER(attempt + 1));
+        httpStatusCode = transmit(msg);
+        if (!mRetryPolicy.isTransient(httpStatusCode)) {
+            break;
+        }
+    }
+
+    if (options.deadline > 0) {
+        QMutexLocker locker(&mMutex);
+        mDeadlines.remove(options.deadline, msg);
+    }
+    options.token.detach(msg);
+    deactivate(msg);
+
+    return httpStatusCode;
+}
+
+int Session::attempts(SoupMessage *msg)
+{
+    return GPOINTER_TO_INT(g_object_get_data(G_OBJECT(msg), ATTEMPTS_KEY));
+}
+
+// Messages stay cancellable for as long as anything is sending them
+void Session::activate(SoupMessage *msg)
+{
+    QMutexLocker locker(&mMutex);
+    mActive[msg]++;
+}
+
+void Session::deactivate(SoupMessage *msg)
+{
+    QMutexLocker locker(&mMutex);
+
+    if (--mActive[msg] <= 0) {
+        mActive.remove(msg);
+        mCancelled.remove(msg);
+    }
+}
+
+// libsoup ignores cancelling a message it hasn't queued yet, so a message
+// only counts as sending once it's queued, and a cancel that came earlier
+// is applied then
+void Session::queued(SoupSession *soup, SoupMessage *msg, gpointer data)
+{
+    auto session = static_cast<Session *>(data);
+    QMutexLocker locker(&session->mMutex);
+
+    if (!session->mActive.contains(msg)) {
+        return;
+    }
+
+    session->mSending.insert(msg);
+    if (session->mCancelled.contains(msg)) {
+        soup_session_cancel_message(soup, msg, session->mCancelled.value(msg));
+    }
+}
+
+void Session::cancel(SoupMessage *msg, guint status)
+{
+    QMutexLocker locker(&mMutex);
+    cancelLocked(msg, status);
+}
+
+// Only the message is aborted; its connection is closed, the others are left alone
+void Session::cancelLocked(SoupMessage *msg, guint status)
+{
+    if (!mActive.contains(msg) || mCancelled.contains(msg)) {
+        return;
+    }
+
+    mCancelled.insert(msg, status);
+    if (mSending.contains(msg)) {
+        soup_session_cancel_message(mSession, msg, status);
+    }
+    mCancelledChanged.wakeAll();
+}
+
+void Session::watchdog()
+{
+    QMutexLocker locker(&mMutex);
+
+    while (!mStopping) {
+        if (mDeadlines.isEmpty()) {
+            mDeadlinesChanged.wait(&mMutex);
+            continue;
+        }
+
+        auto now = QDateTime::currentMSecsSinceEpoch();
+        auto first = mDeadlines.begin();
+        if (first.key() > now) {
+            mDeadlinesChanged.wait(&mMutex, static_cast<unsigned long>(first.key() - now));
+            continue;
+        }
+
+        auto msg = first.value();
+        mDeadlines.erase(first);
+        cancelLocked(msg, DeadlineExceededStatus);
+    }
+}
+
+void Session::setCircuitBreaker(double failureRate, int minRequests, int slowCall, int openDuration)
+{
+    QMutexLocker locker(&mMutex);
+
+    mBreakerFailureRate = failureRate;
+    mBreakerMinRequests = minRequests;
+    mBreakerSlowCall = slowCall;
+    mBreakerOpenDuration = openDuration;
+    for (auto breaker : mBreakers) {
+        breaker->configure(failureRate, minRequests, slowCall, openDuration);
+    }
+}
+
+CircuitBreaker::State Session::circuitState(const QString &url) const
+{
+    auto host = hostOf(url);
+
+    QMutexLocker locker(&mMutex);
+    auto breaker = mBreakers.value(host);
+    return breaker ? breaker->state() : CircuitBreaker::Closed;
+}
+
+CircuitBreaker *Session::breaker(const QString &host)
+{
+    QMutexLocker locker(&mMutex);
+    auto breaker = mBreakers.value(host);
+
+    if (!breaker) {
+        breaker = new CircuitBreaker();
+        breaker->configure(mBreakerFailureRate, mBreakerMinRequests, mBreakerSlowCall, mBreakerOpenDuration);
+        mBreakers.insert(host, breaker);
+    }
+    return breaker;
+}
+
+void Session::setConcurrencyLimit(int initial, int minimum, int maximum, double tolerance)
+{
+    QMutexLocker locker(&mMutex);
+
+    mLimitInitial = initial;
+    mLimitMinimum = minimum;
+    mLimitMaximum = maximum;
+    mLimitTolerance = tolerance;
+    for (auto limiter : mLimiters) {
+        configureLimiter(limiter);
+    }
+}
+
+// Requests over the per-host connection limit queue inside libsoup, where
+// the limiter would take the wait for the service queueing, so the limit
+// never goes beyond it
+void Session::configureLimiter(ConcurrencyLimiter *limiter)
+{
+    auto maximum = qMin(mLimitMaximum, mMaxConnectionsPerHost);
+    limiter->configure(qMin(mLimitInitial, maximum), mLimitMinimum, maximum, mLimitTolerance);
+}
+
+ConcurrencyLimiter *Session::limiter(const QString &host)
+{
+    QMutexLocker locker(&mMutex);
+    auto limiter = mLimiters.value(host);
+
+    if (!limiter) {
+        limiter = new ConcurrencyLimiter();
+        configureLimiter(limiter);
+        mLimiters.insert(host, limiter);
+    }
+    return limiter;
+}
+
+guint Session::transmit(SoupMessage *msg)
+{
+    auto host = hostOf(soup_message_get_uri(msg));
+    auto circuit = breaker(host);
+    auto slots = limiter(host);
+    QElapsedTimer timer;
+    int generation;
+
+    if (!circuit->allow(&generation)) {
+        soup_message_set_status_full(msg, CircuitOpenStatus, "Circuit open");
+        return CircuitOpenStatus;
+    }
+
+    // Waiting for a slot stops as soon as the request is cancelled
+    bool acquired = false;
+    forever {
+        mMutex.lock();
+        if (mCancelled.contains(msg)) {
+            auto status = mCancelled.value(msg);
+            mMutex.unlock();
+            if (acquired) {
+                slots->release();
+            }
+            circuit->release(generation);
+            soup_message_set_status_full(msg, status, status == DeadlineExceededStatus ? "Deadline exceeded" : "Cancelled");
+            return status;
+        }
+        if (acquired) {
+            break;
+        }
+        mMutex.unlock();
+        acquired = slots->acquire(SLOT_WAIT);
+    }
+    mInFlight++;
+    mPeakInFlight = qMax(mPeakInFlight, mInFlight);
+    mInFlightPerHost[host]++;
+    mMutex.unlock();
+
+    timer.start();
+    auto httpStatusCode = soup_session_send_message(mSession, msg);
+
+    mMutex.lock();
+    mSending.remove(msg);
+    mInFlight--;
+    mInFlightPerHost[host]--;
+    mRequests++;
+    mLastActivity[host] = QDateTime::currentMSecsSinceEpoch();
+    if (SOUP_STATUS_IS_SUCCESSFUL(httpStatusCode)) {
+        record(host, static_cast<int>(timer.elapsed()));
+    }
+    mMutex.unlock();
+
+    if (httpStatusCode == SOUP_STATUS_CANCELLED || httpStatusCode == DeadlineExceededStatus) {
+        circuit->release(generation);
+        slots->release();
+    } else {
+        circuit->record(generation, CircuitBreaker::isFailure(httpStatusCode), static_cast<int>(timer.elapsed()));
+        slots->record(httpStatusCode, static_cast<int>(timer.elapsed()));
+    }
+    Router::instance()->report(host, httpStatusCode, static_cast<int>(timer.elapsed()));
+
+    return httpStatusCode;
+}
+
+void Session::setHedging(double percentile, double budget)
+{
+    QMutexLocker locker(&mMutex);
+
+    mHedgePercentile = percentile;
+    mHedgeBudget = budget;
+}
+
+guint Session::hedge(SoupMessage *msg, const Sender &sender, const QString &alternate)
+{
+    struct Race {
+        QMutex         mutex;
+        QWaitCondition changed;
+        SoupMessage *  messages[2];
+        guint          status[2];
+        bool           done[2];
+        int            started;
+        int            winner;
+    };
+
+    auto host = hostOf(soup_message_get_uri(msg));
+    auto delay = hedgeDelay(host);
+    if (delay < 0) {
+        return sender(msg);
+    }
+
+    // The duplicate is made up front, since msg can't be read while it's being sent
+    auto race = std::make_shared<Race>();
+    race->messages[0] = msg;
+    race->messages[1] = duplicate(msg, alternate);
+    race->done[0] = race->done[1] = false;
+    race->started = 1;
+    race->winner = -1;
+    activate(race->messages[0]);
+    activate(race->messages[1]);
+
+    // The first request whose outcome isn't worth retrying wins; otherwise the last to finish does
+    auto run = [this, race, sender](int i) {
+        auto status = sender(race->messages[i]);
+
+        QMutexLocker locker(&race->mutex);
+        race->status[i] = status;
+        race->done[i] = true;
+        if (race->winner < 0) {
+            auto others = race->started == 2 && !race->done[1 - i];
+            if (!others || (!mRetryPolicy.isTransient(status) && status != SOUP_STATUS_CANCELLED)) {
+                race->winner = i;
+            }
+        }
+        race->changed.wakeAll();
+    };
+
+    QtConcurrent::run(&mHedgePool, [run]() { run(0); });
+
+    QMutexLocker locker(&race->mutex);
+    QElapsedTimer timer;
+    timer.start();
+    while (!race->done[0] && timer.elapsed() < delay) {
+        race->changed.wait(&race->mutex, static_cast<unsigned long>(delay - timer.elapsed()));
+    }
+    if (!race->done[0] && race->winner < 0 && withdrawHedge()) {
+        race->started = 2;
+        QtConcurrent::run(&mHedgePool, [run]() { run(1); });
+    }
+    while (race->winner < 0) {
+        race->changed.wait(&race->mutex);
+    }
+
+    auto winner = race->winner;
+    auto loser = 1 - winner;
+    if (race->started == 2) {
+        if (!race->done[loser]) {
+            cancel(race->messages[loser]);
+        }
+        while (!race->done[loser]) {
+            race->changed.wait(&race->mutex);
+        }
+    }
+    locker.unlock();
+    deactivate(race->messages[0]);
+    deactivate(race->messages[1]);
+
+    if (winner == 1) {
+        adopt(msg, race->messages[1]);
+        mMutex.lock();
+        mHedgeWins++;
+        mMutex.unlock();
+    }
+    g_object_unref(race->messages[1]);
+
+    return race->status[winner];
+}
+
+// Called with mMutex held
+void Session::record(const QString &host, int msecs)
+{
+    auto &latencies = mLatencies[host];
+
+    if (latencies.samples.size() < LATENCY_SAMPLES) {
+        latencies.samples.append(msecs);
+    } else {
+        latencies.samples[latencies.next] = msecs;
+    }
+    latencies.next = (latencies.next + 1) % LATENCY_SAMPLES;
+}
+
+// Milliseconds to wait for host before hedging, -1 if the request shouldn't be hedged
+int Session::hedgeDelay(const QString &host)
+{
+    QMutexLocker locker(&mMutex);
+    auto now = QDateTime::currentMSecsSinceEpoch();
+
+    while (!mHedgeable.isEmpty() && mHedgeable.head() <= now - HEDGE_WINDOW) {
+        mHedgeable.dequeue();
+    }
+    mHedgeable.enqueue(now);
+
+    auto samples = mLatencies.value(host).samples;
+    if (mHedgePercentile <= 0 || mHedgeBudget <= 0 || samples.size() < MIN_LATENCY_SAMPLES) {
+        return -1;
+    }
+
+    auto index = qMin(static_cast<int>(samples.size() * mHedgePercentile), samples.size() - 1);
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+bool Session::withdrawHedge()
+{
+    QMutexLocker locker(&mMutex);
+    auto now = QDateTime::currentMSecsSinceEpoch();
+
+    while (!mHedged.isEmpty() && mHedged.head() <= now - HEDGE_WINDOW) {
+        mHedged.dequeue();
+    }
+    if (mHedged.size() + 1 > mHedgeBudget * mHedgeable.size()) {
+        return false;
+    }
+    mHedged.enqueue(now);
+    mHedges++;
+    return true;
+}
+
+Session::Stats Session::stats() const
+{
+    QMutexLocker locker(&mMutex);
+    Stats stats;
+
+    stats.maxConnections = mMaxConnections;
+    stats.maxConnectionsPerHost = mMaxConnectionsPerHost;
+    stats.inFlight = mInFlight;
+    stats.peakInFlight = mPeakInFlight;
+    stats.requests = mRequests;
+    stats.retries = mRetries;
+    stats.hedges = mHedges;
+    stats.hedgeWins = mHedgeWins;
+    stats.inFlightPerHost = mInFlightPerHost;
+    for (auto it = mBreakers.constBegin(); it != mBreakers.constEnd(); ++it) {
+        stats.circuits.insert(it.key(), it.value()->state());
+    }
+    for (auto it = mLimiters.constBegin(); it != mLimiters.constEnd(); ++it) {
+        stats.concurrencyLimits.insert(it.key(), it.value()->limit());
+    }
+
+    return stats;
+}
+
+}
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <libsoup/soup.h>
+#include <QHash>
+#include <QMultiMap>
+#include <QMutex>
+#include <QQueue>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <QVector>
+#include <QWaitCondition>
+#include <functional>
+#include <thread>
+#include "circuitbreaker.hpp"
+#include "concurrencylimiter.hpp"
+#include "requestoptions.hpp"
+#include "retrypolicy.hpp"
+
+namespace Bing {
+
+/**
+ * HTTP transport shared by Speech, QnaMaker and CustomVision.
+ *
+ * A single SoupSession means connections, TLS sessions and resolved
+ * addresses are reused across every client in the process.
+ */
+class Session {
+public:
+    struct Stats {
+        int                 maxConnections;
+        int                 maxConnectionsPerHost;
+        int                 inFlight;
+        int                 peakInFlight;
+        qint64              requests;
+        qint64              retries;
+        qint64              hedges;
+        qint64              hedgeWins;
+        QHash<QString, int> inFlightPerHost;
+        QHash<QString, CircuitBreaker::State> circuits;
+        QHash<QString, int> concurrencyLimits;
+
+        /**
+         * Share of the total connection limit in use
+         */
+        double utilization() const;
+    };
+
+    static Session *instance();
+
+    /**
+     * Name the session tracks the endpoint of uri by: its host, plus the
+     * port when it isn't the scheme's default
+     */
+    static QString hostOf(SoupURI *uri);
+    static QString hostOf(const QString &url);
+
+    SoupSession *soup() const;
+
+    /**
+     * Raises the logging level of the session, keeping the most verbose
+     * level any client has asked for
+     *
+     * \param log 0 for none, 1 for minimal, 2 for headers and 3 for bodies
+     */
+    void enableLogging(int log);
+
+    void setMaxConnections(int total, int perHost);
+    void setTimeout(unsigned int secs);
+    void setIdleTimeout(unsigned int secs);
+
+    /**
+     * Resolves and connects to the hosts of urls ahead of the first request
+     *
+     * \param urls Endpoints the clients are going to use
+     * \param connections Number of connections to open per host
+     * \param wait Whether to block until the connections are up
+     */
+    void prewarm(const QStringList &urls, int connections = 1, bool wait = false);
+
+    /**
+     * Keeps connections to every prewarmed host open while it's idle
+     *
+     * \param connections Minimum number of live connections per host, 0 to disable
+     * \param intervalSecs How long a host may stay idle before it's pinged, at least 1
+     */
+    void setKeepWarm(int connections, int intervalSecs = 30);
+
+    /**
+     * Policy applied to transient failures of every request
+     */
+    RetryPolicy *retryPolicy();
+
+    /**
+     * Circuit breaker parameters for every host, see CircuitBreaker::configure()
+     */
+    void setCircuitBreaker(double failureRate, int minRequests, int slowCall, int openDuration);
+
+    /**
+     * State of the circuit breaker of the host of url; requests to a host
+     * whose breaker is open fail right away with CircuitOpenStatus
+     */
+    CircuitBreaker::State circuitState(const QString &url) const;
+
+    /**
+     * Adaptive concurrency limit of every host, see ConcurrencyLimiter::configure();
+     * requests over a host's limit wait for a slot before they're sent. The
+     * limit never exceeds the connections per host, which it starts at by
+     * default.
+     */
+    void setConcurrencyLimit(int initial, int minimum, int maximum, double tolerance);
+
+    /**
+     * Called before every attempt at a request; from the second attempt
+     * on, msg still holds the response that failed
+     */
+    typedef std::function<void(SoupMessage *msg, int attempt)> Prepare;
+
+    /**
+     * Sends msg synchronously and returns its status code, retrying
+     * transient failures
+     *
+     * \param msg Request to send
+     * \param prepare Sets per-attempt headers, e.g. credentials
+     * \param retryable False when the body can't be sent twice, e.g. when streamed
+     * \param options Deadline and cancellation token of the request
+     */
+    guint send(SoupMessage *msg, const Prepare &prepare = Prepare(), bool retryable = true, const RequestOptions &options = RequestOptions());
+
+    /**
+     * Attempts the last send() of msg made, retries included
+     */
+    static int attempts(SoupMessage *msg);
+
+    /**
+     * Aborts msg with status if it's being sent, including while it waits
+     * to be retried; safe to call from any thread
+     */
+    void cancel(SoupMessage *msg, guint status = SOUP_STATUS_CANCELLED);
+
+    /**
+     * Hedging parameters shared by every client that opts in
+     *
+     * \param percentile Latency percentile of the host after which a duplicate is sent
+     * \param budget Share of hedgeable requests that may be duplicated
+     */
+    void setHedging(double percentile, double budget);
+
+    /**
+     * Sends the complete request msg through sender, racing a duplicate
+     * against it when no response arrived within the host's hedge delay.
+     * The first usable response ends up in msg and the other request is
+     * cancelled. Only meant for idempotent requests.
+     *
+     * \param msg Request to send
+     * \param sender Sends one copy of the request, e.g. with credentials
+     * \param alternate Base URL of another endpoint for the duplicate, if any
+     */
+    typedef std::function<guint(SoupMessage *msg)> Sender;
+    guint hedge(SoupMessage *msg, const Sender &sender, const QString &alternate = QString());
+
+    Stats stats() const;
+
+private:
+    Session();
+    ~Session();
+    Session(const Session &);
+    Session &operator=(const Session &);
+
+    SoupSession *       mSession;
+    int                 mLogLevel;
+    mutable QMutex      mMutex;
+    int                 mMaxConnections;
+    int                 mMaxConnectionsPerHost;
+    int                 mInFlight;
+    int                 mPeakInFlight;
+    qint64              mRequests;
+    qint64              mRetries;
+    RetryPolicy         mRetryPolicy;
+    QHash<QString, int> mInFlightPerHost;
+    QHash<SoupMessage *, int> mActive;
+    QSet<SoupMessage *> mSending;
+    QHash<SoupMessage *, guint> mCancelled;
+    QWaitCondition      mCancelledChanged;
+
+    QMultiMap<qint64, SoupMessage *> mDeadlines;
+    QWaitCondition                   mDeadlinesChanged;
+    std::thread                      mWatchdogThread;
+
+    QHash<QString, CircuitBreaker *> mBreakers;
+    double                           mBreakerFailureRate;
+    int                              mBreakerMinRequests;
+    int                              mBreakerSlowCall;
+    int                              mBreakerOpenDuration;
+
+    QHash<QString, ConcurrencyLimiter *> mLimiters;
+    int                                  mLimitInitial;
+    int                                  mLimitMinimum;
+    int                                  mLimitMaximum;
+    double                               mLimitTolerance;
+
+    struct Latencies {
+        QVector<int> samples;
+        int          next;
+    };
+
+    QThreadPool               mHedgePool;
+    double                    mHedgePercentile;
+    double                    mHedgeBudget;
+    QHash<QString, Latencies> mLatencies;
+    QQueue<qint64>            mHedgeable;
+    QQueue<qint64>            mHedged;
+    qint64                    mHedges;
+    qint64                    mHedgeWins;
+
+    QThreadPool            mWarmPool;
+    QHash<QString, QString> mWarmHosts;
+    QHash<QString, qint64>  mLastActivity;
+    int                     mKeepWarmConnections;
+    int                     mKeepWarmInterval;
+    bool                    mStopping;
+    QWaitCondition          mKeepWarmChanged;
+    std::thread             mKeepWarmThread;
+
+    guint transmit(SoupMessage *msg);
+    CircuitBreaker *breaker(const QString &host);
+    ConcurrencyLimiter *limiter(const QString &host);
+    void configureLimiter(ConcurrencyLimiter *limiter);
+    void cancelLocked(SoupMessage *msg, guint status);
+    static void queued(SoupSession *soup, SoupMessage *msg, gpointer session);
+    void watchdog();
+    void activate(SoupMessage *msg);
+    void deactivate(SoupMessage *msg);
+    void record(const QString &host, int msecs);
+    int hedgeDelay(const QString &host);
+    bool withdrawHedge();
+    void connect(const QString &baseUrl, int connections);
+    void keepWarm();
+};
+
+}
@@ -1,124 +1,190 @@
 #include "speech.hpp"
+#include "ringbuffer.hpp"
+#include "tokenmanager.hpp"
+#include "session.hpp"
+#include "router.hpp"
+#include "ratelimiter.hpp"
 #include "exception.hpp"
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <sstream>
+#include <QDateTime>
 #include <QDir>
 #include <QFile>
+#include <QFileInfo>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QSaveFile>
 #include <QCryptographicHash>
-#include <QTimer>
+#include <QMutex>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent>
 #include <QDebug>
 #include <libgen.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace Bing {
 
 const QString FETCH_TOKEN_URI      = "https://api.cognitive.microsoft.com/sts/v1.0/issueToken";
-const QString RECOGNITION_URL      = "https://speech.platform.bing.com/speech/recognition/";
-const QString SYNTHESIZE_URL       = "https://speech.platform.bing.com/synthesize";
-const int     RENEW_TOKEN_INTERVAL = 9; // Minutes before renewing token
+const QString CUSTOM_FETCH_TOKEN_URI = "https://westus.api.cognitive.microsoft.com/sts/v1.0/issueToken";
+const QString RECOGNITION_PATH     = "/speech/recognition/";
+const QString SYNTHESIZE_PATH      = "/synthesize";
 
-Speech *Speech::mInstance;
-SoupSession *Speech::mSession;
-QTimer *Speech::mRenewTokenTimer;
-QString Speech::mRecognizerSubscriptionKey;
-QString Speech::mRecognizerToken;
-QString Speech::mSynthesizerSubscriptionKey;
-QString Speech::mSynthesizerToken;
-QString Speech::mConnectionId;
-QString Speech::mEndpointId;
-bool Speech::mCache;
+// 16-bit mono 16000hz PCM header expected by custom speech endpoints
+const unsigned char WAV_HEADER[] = {
+    0x52, 0x49, 0x46, 0x46, 0xc4, 0x09, 0x01, 0x00, 0x57, 0x41, 0x56,
+    0x45, 0x66, 0x6d, 0x74, 0x20, 0x10, 0x00, 0x00, 0x00, 0x01, 0x00,
+    0x01, 0x00, 0x80, 0x3e, 0x00, 0x00, 0x00, 0x7d, 0x00, 0x00, 0x02,
+    0x00, 0x10, 0x00, 0x64, 0x61, 0x74, 0x61, 0xa0, 0x09, 0x01, 0x00
+};
 
-void Speech::init(int log)
+const int     UPLOAD_CHUNK_SIZE    = 4096; // Bytes per chunk when streaming audio
+const int     UPLOAD_POLL_INTERVAL = 1000; // Microseconds to wait for more streamed audio
+
+const int     RECOGNITION_CACHE_ENTRIES = 1024; // Responses kept in memory
+
+static void releaseSharedBuffer(gpointer owner)
 {
-    if (mSession) {
-        return;
-    }
+    delete static_cast<QByteArray *>(owner);
+}
+
+// Appends data to body by holding a reference to it instead of a copy
+static void appendSharedBuffer(SoupMessageBody *body, const QByteArray &data)
+{
+    auto owner = new QByteArray(data);
+    auto buffer = soup_buffer_new_with_owner(owner->constData(), owner->size(), owner, releaseSharedBuffer);
+
+    soup_message_body_append_buffer(body, buffer);
+    soup_buffer_free(buffer);
+}
+
+struct Mapping {
+    void * data;
+    size_t size;
+};
+
+static void releaseMapping(gpointer owner)
+{
+    auto mapping = static_cast<Mapping *>(owner);
+
+    munmap(mapping->data, mapping->size);
+    delete mapping;
+}
+
+struct Upload {
+    std::function<int(char *data, int size)> reader;
+    QByteArray chunk;
+    int        error; // errno of a failed read, 0 if none
+};
 
-    SoupLogger *logger;
-    SoupLoggerLogLevel logLevel;
+// Queues the next streamed chunk once the previous one is on the wire, so
+// the preallocated chunk is reused without libsoup ever copying it
+static void writeNextChunk(SoupMessage *msg, gpointer userData)
+{
+    auto upload = static_cast<Upload *>(userData);
+    auto size = upload->reader(upload->chunk.data(), upload->chunk.size());
 
-    if (log <= 0) {
-        logLevel = SOUP_LOGGER_LOG_NONE;
-    } else if (log == 1) {
-        logLevel = SOUP_LOGGER_LOG_MINIMAL;
-    } else if (log == 2) {
-        logLevel = SOUP_LOGGER_LOG_HEADERS;
+    if (size > 0) {
+        soup_message_body_append(msg->request_body, SOUP_MEMORY_STATIC, upload->chunk.constData(), size);
+    } else if (size == 0) {
+        soup_message_body_complete(msg->request_body);
     } else {
-        logLevel = SOUP_LOGGER_LOG_BODY;
+        // Truncated audio must not be recognized as if it were complete
+        upload->error = errno;
+        switch (upload->error) {
+        case ETIMEDOUT: Session::instance()->cancel(msg, DeadlineExceededStatus); break;
+        case ECANCELED: Session::instance()->cancel(msg, SOUP_STATUS_CANCELLED); break;
+        default: Session::instance()->cancel(msg, SOUP_STATUS_IO_ERROR); break;
+        }
     }
+}
+
+static QByteArray bearer(TokenManager *tokens, const RequestOptions &options)
+{
+    return "Bearer " + (tokens ? tokens->token(options) : QString()).toUtf8();
+}
 
-    mSession = soup_session_new_with_options(SOUP_SESSION_ADD_FEATURE_BY_TYPE, SOUP_TYPE_CONTENT_SNIFFER, NULL);
-    logger = soup_logger_new(logLevel, -1);
-    soup_session_add_feature(mSession, SOUP_SESSION_FEATURE(logger));
-    g_object_unref(logger);
+Speech *Speech::mInstance;
+QMutex Speech::mInstanceMutex;
+QCache<QString, QByteArray> Speech::mRecognitionMemoryCache(RECOGNITION_CACHE_ENTRIES);
+QMutex Speech::mRecognitionCacheMutex;
+
+Speech::Speech(int log, QObject *parent) :
+    QObject(parent),
+    mCache(false),
+    mRecognitionCache(false),
+    mHedging(false),
+    mTimeout(0)
+{
+    Session::instance()->enableLogging(log);
+}
+
+Speech::~Speech()
+{
+}
+
+void Speech::init(int log)
+{
+    Session::instance()->enableLogging(log);
 }
 
 void Speech::destroy()
 {
-    if (mSession) {
-        g_object_unref(mSession);
-        mSession = NULL;
-    }
+    QMutexLocker locker(&mInstanceMutex);
 
-    mRecognizerToken.clear();
-    mSynthesizerToken.clear();
     delete mInstance;
+    mInstance = nullptr;
 }
 
 Speech *Speech::instance()
 {
-    if (mInstance) {
-        return mInstance;
-    }
+    QMutexLocker locker(&mInstanceMutex);
 
-    return new Speech();
+    if (!mInstance) {
+        mInstance = new Speech();
+    }
+    return mInstance;
 }
 
 void Speech::authenticate(const QString &recognizerSubscriptionKey, const QString &synthesizerSubscriptionKey)
 {
-    mRecognizerSubscriptionKey = recognizerSubscriptionKey;
-    mSynthesizerSubscriptionKey = synthesizerSubscriptionKey;
+    authenticate(QStringList() << recognizerSubscriptionKey, QStringList() << synthesizerSubscriptionKey);
+}
 
-    Speech::fetchToken();
+void Speech::authenticate(const QStringList &recognizerSubscriptionKeys, const QStringList &synthesizerSubscriptionKeys)
+{
+    setSubscriptionKeys(mRecognizer, recognizerSubscriptionKeys, recognizerIssueUrl());
+    setSubscriptionKeys(mSynthesizer, synthesizerSubscriptionKeys, FETCH_TOKEN_URI);
+}
 
-    delete mRenewTokenTimer;
-    mRenewTokenTimer = new QTimer(this);
-    connect(mRenewTokenTimer, &QTimer::timeout, this, &Speech::renewToken);
-    mRenewTokenTimer->start(RENEW_TOKEN_INTERVAL * 60 * 1000);
+void Speech::setKeyStrategy(KeyPool::Strategy strategy, int requestsPerMinute)
+{
+    mRecognizer.keys.setStrategy(strategy);
+    mRecognizer.keys.setQuota(requestsPerMinute);
+    mSynthesizer.keys.setStrategy(strategy);
+    mSynthesizer.keys.setQuota(requestsPerMinute);
 }
 
 void Speech::fetchToken()
 {
-    SoupMessage *msg;
-    SoupMessageBody *body;
+    QReadLocker locker(&mLock);
 
-    mRecognizerToken.clear();
-    mSynthesizerToken.clear();
-
-    // Recognizer
-    if (mEndpointId.isEmpty()) {
-        msg = soup_message_new("POST", FETCH_TOKEN_URI.toUtf8().data());
-    } else {
-        msg = soup_message_new("POST", "https://westus.api.cognitive.microsoft.com/sts/v1.0/issueToken");
+    // Tokens are fetched concurrently in the background and swapped in
+    // when they arrive, so requests keep using the current ones meanwhile
+    for (auto tokens : mRecognizer.tokens) {
+        tokens->refresh();
+    }
+    for (auto tokens : mSynthesizer.tokens) {
+        tokens->refresh();
     }
-    soup_message_headers_append(msg->request_headers, "Content-Length", "0");
-    soup_message_headers_append(msg->request_headers, "Ocp-Apim-Subscription-Key", mRecognizerSubscriptionKey.toUtf8().data());
-    soup_session_send_message(mSession, msg);
-    g_object_get(msg, "response-body", &body, NULL);
-    mRecognizerToken = QByteArray(body->data, body->length);
-
-    // Synthesizer
-    msg = soup_message_new("POST", FETCH_TOKEN_URI.toUtf8().data());
-    soup_message_headers_append(msg->request_headers, "Content-Length", "0");
-    soup_message_headers_append(msg->request_headers, "Ocp-Apim-Subscription-Key", mSynthesizerSubscriptionKey.toUtf8().data());
-    soup_session_send_message(mSession, msg);
-    g_object_get(msg, "response-body", &body, NULL);
-    mSynthesizerToken = QByteArray(body->data, body->length);
 }
 
 void Speech::setCache(bool cache)
@@ -126,33 +192,292 @@ void Speech::setCache(bool cache)
     mCache = cache;
 }
 
+void Speech::setRecognitionCache(bool cache)
+{
+    mRecognitionCache = cache;
+}
+
+void Speech::setHedging(bool hedging)
+{
+    mHedging = hedging;
+}
+
 void Speech::setEndpointId(const QString &endpointId)
 {
+    mLock.lockForWrite();
     mEndpointId = endpointId;
+    mLock.unlock();
+
+    auto issueUrl = recognizerIssueUrl();
+    QReadLocker locker(&mLock);
+    for (auto key : mRecognizer.tokens.keys()) {
+        auto tokens = mRecognizer.tokens[key];
+        tokens->setIssueUrl(issueUrl);
+        if (!mTokenStore.isEmpty()) {
+            tokens->setStorePath(tokenStorePath(issueUrl, key));
+        }
+        tokens->refresh();
+    }
+}
+
+void Speech::setTokenStore(const QString &directory)
+{
+    QWriteLocker locker(&mLock);
+    mTokenStore = directory;
 }
 
 void Speech::setTimeout(unsigned int secs)
 {
-    if (!mSession) {
-        return;
+    // Applied per request rather than to the session, which is shared with
+    // the other clients
+    mTimeout = secs;
+}
+
+void Speech::prewarm(int connections, bool wait)
+{
+    QStringList urls;
+
+    urls << recognizerIssueUrl() << FETCH_TOKEN_URI;
+    urls << Router::instance()->endpoints(Router::SynthesisService);
+    urls << Router::instance()->endpoints(recognitionService());
+    Session::instance()->prewarm(urls, connections, wait);
+}
+
+Speech::RecognitionResponse Speech::recognize(const QByteArray &data, RecognitionLanguage language, RecognitionMode mode, const RequestOptions &options)
+{
+    return tryRecognize(data, language, mode, options).get();
+}
+
+Result<Speech::RecognitionResponse> Speech::tryRecognize(const QByteArray &data, RecognitionLanguage language, RecognitionMode mode, const RequestOptions &options)
+{
+    QString cacheKey;
+    QElapsedTimer timer;
+
+    timer.start();
+    if (mRecognitionCache) {
+        RecognitionResponse res;
+        cacheKey = recognitionCacheKey(data, language, mode);
+        if (findRecognitionCache(cacheKey, language, &res)) {
+            return Result<RecognitionResponse>::cached(res);
+        }
     }
 
-    g_object_set(mSession, SOUP_SESSION_TIMEOUT, secs, NULL);
-    g_object_set(mSession, SOUP_SESSION_IDLE_TIMEOUT, secs, NULL);
-    soup_session_abort(mSession);
+    auto msg = recognitionMessage(language, mode);
+    appendSharedBuffer(msg->request_body, data);
+    auto httpStatusCode = sendAuthorized(msg, mRecognizer, recognitionService(), options);
+
+    return recognitionResult(msg, httpStatusCode, language, timer, cacheKey);
 }
 
-void Speech::renewToken()
+Speech::RecognitionResponse Speech::recognize(const QByteArray &data, const QList<RecognitionLanguage> &languages, RecognitionMode mode, double winningConfidence, const RequestOptions &options)
 {
-    Speech::fetchToken();
-    fprintf(stdout, "%s\n", "Renewed access token");
+    return tryRecognize(data, languages, mode, winningConfidence, options).get();
 }
 
-Speech::RecognitionResponse Speech::recognize(const QByteArray &data, RecognitionLanguage language, RecognitionMode mode)
+Result<Speech::RecognitionResponse> Speech::tryRecognize(const QByteArray &data, const QList<RecognitionLanguage> &languages, RecognitionMode mode, double winningConfidence, const RequestOptions &options)
+{
+    QThreadPool pool;
+    QList<QFuture<Result<RecognitionResponse>>> futures;
+    QElapsedTimer timer;
+
+    if (languages.isEmpty()) {
+        return tryRecognize(data, EnglishUnitedStates, mode, options);
+    }
+
+    // The losers are cancelled through a token of their own, which the caller's token also cancels
+    auto raceOptions = options;
+    raceOptions.token = options.token.child();
+
+    // Every request body references the same audio buffer, so one copy is held for all of them
+    timer.start();
+    pool.setMaxThreadCount(languages.size());
+    for (auto language : languages) {
+        futures.append(QtConcurrent::run(&pool, [&, language]() -> Result<RecognitionResponse> {
+            Result<RecognitionResponse> result;
+            QString cacheKey;
+
+            if (mRecognitionCache) {
+                cacheKey = recognitionCacheKey(data, language, mode);
+            }
+
+            if (cacheKey.isEmpty() || !findRecognitionCache(cacheKey, language, &result.value)) {
+                auto msg = recognitionMessage(language, mode);
+
+                appendSharedBuffer(msg->request_body, data);
+                auto httpStatusCode = sendAuthorized(msg, mRecognizer, recognitionService(), raceOptions);
+                result = recognitionResult(msg, httpStatusCode, language, timer, cacheKey);
+                if (!result.ok()) {
+                    return result;
+                }
+            } else {
+                result = Result<RecognitionResponse>::cached(result.value);
+            }
+
+            // Cancel the remaining requests once a clear winner is in
+            if (winningConfidence > 0 && result.value.hasMatch() && result.value.confidence() >= winningConfidence) {
+                raceOptions.token.cancel();
+            }
+            return result;
+        }));
+    }
+    pool.waitForDone();
+
+    // Prefer the most confident match, then any answered request, then the first error
+    int best = -1;
+    for (auto i = 0; i < futures.size(); i++) {
+        auto result = futures[i].result();
+        if (!result.ok()) {
+            continue;
+        }
+        if (best < 0) {
+            best = i;
+            continue;
+        }
+
+        auto current = futures[best].result().value;
+        if (result.value.hasMatch() && (!current.hasMatch() || result.value.confidence() > current.confidence())) {
+            best = i;
+        }
+    }
+
+    return futures[best < 0 ? 0 : best].result();
+}
+
+Speech::RecognitionResponse Speech::recognize(AudioRingBuffer &buffer, RecognitionLanguage language, RecognitionMode mode, const RequestOptions &options)
+{
+    return tryRecognize(buffer, language, mode, options).get();
+}
+
+Result<Speech::RecognitionResponse> Speech::tryRecognize(AudioRingBuffer &buffer, RecognitionLanguage language, RecognitionMode mode, const RequestOptions &callerOptions)
+{
+    auto options = requestOptions(callerOptions);
+    auto reader = [&buffer, options](char *data, int size) -> int {
+        forever {
+            auto count = buffer.read(data, size);
+            if (count > 0 || buffer.atEnd()) {
+                return count;
+            }
+
+            // A stalled producer mustn't keep the request past its deadline
+            if (options.token.isCancelled()) {
+                errno = ECANCELED;
+                return -1;
+            }
+            if (options.deadline > 0 && QDateTime::currentMSecsSinceEpoch() >= options.deadline) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            QThread::usleep(UPLOAD_POLL_INTERVAL);
+        }
+    };
+
+    return recognizeStream(reader, language, mode, options);
+}
+
+Speech::RecognitionResponse Speech::recognizeFile(const QString &path, RecognitionLanguage language, RecognitionMode mode, const RequestOptions &options)
+{
+    return tryRecognizeFile(path, language, mode, options).get();
+}
+
+Result<Speech::RecognitionResponse> Speech::tryRecognizeFile(const QString &path, RecognitionLanguage language, RecognitionMode mode, const RequestOptions &options)
+{
+    int fd = open(path.toUtf8().data(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return Result<RecognitionResponse>::failure(IOError, strerror(errno));
+    }
+
+    auto result = tryRecognizeFile(fd, language, mode, options);
+    close(fd);
+    return result;
+}
+
+Speech::RecognitionResponse Speech::recognizeFile(int fd, RecognitionLanguage language, RecognitionMode mode, const RequestOptions &options)
+{
+    return tryRecognizeFile(fd, language, mode, options).get();
+}
+
+Result<Speech::RecognitionResponse> Speech::tryRecognizeFile(int fd, RecognitionLanguage language, RecognitionMode mode, const RequestOptions &options)
+{
+    struct stat fileStat;
+    void *data = MAP_FAILED;
+    QElapsedTimer timer;
+
+    timer.start();
+    if (fstat(fd, &fileStat) < 0) {
+        return Result<RecognitionResponse>::failure(IOError, strerror(errno));
+    }
+
+    if (S_ISREG(fileStat.st_mode) && fileStat.st_size > 0) {
+        data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    // Pipes and sockets can't be mapped, so stream them in fixed-size chunks
+    if (data == MAP_FAILED) {
+        auto reader = [fd](char *buf, int size) -> int {
+            ssize_t count;
+            do {
+                count = read(fd, buf, size);
+            } while (count < 0 && errno == EINTR);
+            return static_cast<int>(count);
+        };
+        return recognizeStream(reader, language, mode, options);
+    }
+
+    // The request body is the mapping itself, paged in as it's written out
+    auto mapping = new Mapping { data, static_cast<size_t>(fileStat.st_size) };
+    madvise(mapping->data, mapping->size, MADV_SEQUENTIAL);
+
+    QString cacheKey;
+    if (mRecognitionCache) {
+        RecognitionResponse res;
+        cacheKey = recognitionCacheKey(QByteArray::fromRawData(static_cast<const char *>(mapping->data), mapping->size), language, mode);
+        if (findRecognitionCache(cacheKey, language, &res)) {
+            releaseMapping(mapping);
+            return Result<RecognitionResponse>::cached(res);
+        }
+    }
+
+    auto msg = recognitionMessage(language, mode);
+    auto buffer = soup_buffer_new_with_owner(mapping->data, mapping->size, mapping, releaseMapping);
+    soup_message_body_append_buffer(msg->request_body, buffer);
+    soup_buffer_free(buffer);
+    auto httpStatusCode = sendAuthorized(msg, mRecognizer, recognitionService(), options);
+
+    return recognitionResult(msg, httpStatusCode, language, timer, cacheKey);
+}
+
+Result<Speech::RecognitionResponse> Speech::recognizeStream(const ChunkReader &reader, RecognitionLanguage language, RecognitionMode mode, const RequestOptions &options)
+{
+    Upload upload;
+    QElapsedTimer timer;
+    auto msg = recognitionMessage(language, mode);
+
+    upload.reader = reader;
+    upload.chunk.resize(UPLOAD_CHUNK_SIZE);
+    upload.error = 0;
+
+    // Stream with chunked encoding, the first chunk going out right after
+    // the headers unless the WAV header is already queued
+    soup_message_headers_set_encoding(msg->request_headers, SOUP_ENCODING_CHUNKED);
+    soup_message_body_set_accumulate(msg->request_body, FALSE);
+    if (msg->request_body->length == 0) {
+        g_signal_connect(msg, "wrote-headers", G_CALLBACK(writeNextChunk), &upload);
+    }
+    g_signal_connect(msg, "wrote-chunk", G_CALLBACK(writeNextChunk), &upload);
+    timer.start();
+    auto httpStatusCode = sendAuthorized(msg, mRecognizer, recognitionService(), options, false);
+
+    auto result = recognitionResult(msg, httpStatusCode, language, timer);
+    if (upload.error && result.status == SOUP_STATUS_IO_ERROR) {
+        result.reason = strerror(upload.error);
+    }
+    return result;
+}
+
+SoupMessage *Speech::recognitionMessage(RecognitionLanguage language, RecognitionMode mode)
 {
-    Speech::RecognitionResponse res;
     SoupMessage *msg;
-    SoupMessageBody *body;
     QString modeString;
 
     switch (mode) {
@@ -168,39 +493,43 @@ Speech::RecognitionResponse Speech::recognize(const QByteArray &data, Recognitio
         break;
     }
 
-    QString url;
-    if (mEndpointId.isEmpty()) {
-        url = RECOGNITION_URL + modeString + "/cognitiveservices/v1?language=" + recognitionLanguageString(language) + "&format=detailed";
+    auto endpointId = this->endpointId();
+    QString url = Router::instance()->select(endpointId.isEmpty() ? Router::RecognitionService : Router::CustomRecognitionService) + RECOGNITION_PATH + modeString;
+    if (endpointId.isEmpty()) {
+        url += "/cognitiveservices/v1?language=" + recognitionLanguageString(language) + "&format=detailed";
     } else {
-        url = "https://westus.stt.speech.microsoft.com/speech/recognition/" + modeString + "/cognitiveservices/v1?cid=" + mEndpointId + "&format=detailed";
+        url += "/cognitiveservices/v1?cid=" + endpointId + "&format=detailed";
     }
-    QString auth = "Bearer " + mRecognizerToken;
 
-    // Do POST request
+    // Build POST request
     msg = soup_message_new("POST", url.toUtf8().data());
-    if (mEndpointId.isEmpty()) {
-        soup_message_set_request(msg, "audio/wav; codec=\"\"audio/pcm\"\"; samplerate=16000", SOUP_MEMORY_COPY, data.data(), data.size());
+    if (endpointId.isEmpty()) {
+        soup_message_headers_replace(msg->request_headers, "Content-Type", "audio/wav; codec=\"\"audio/pcm\"\"; samplerate=16000");
     } else {
-        QByteArray tmp = data;
-        unsigned char wav_header_bin[] = {
-            0x52, 0x49, 0x46, 0x46, 0xc4, 0x09, 0x01, 0x00, 0x57, 0x41, 0x56,
-            0x45, 0x66, 0x6d, 0x74, 0x20, 0x10, 0x00, 0x00, 0x00, 0x01, 0x00,
-            0x01, 0x00, 0x80, 0x3e, 0x00, 0x00, 0x00, 0x7d, 0x00, 0x00, 0x02,
-            0x00, 0x10, 0x00, 0x64, 0x61, 0x74, 0x61, 0xa0, 0x09, 0x01, 0x00
-        };
-        tmp.prepend(QByteArray(reinterpret_cast<const char *>(wav_header_bin), 44));
-        soup_message_set_request(msg, "application/octet-stream", SOUP_MEMORY_COPY, tmp.data(), tmp.size());
+        soup_message_headers_replace(msg->request_headers, "Content-Type", "application/octet-stream");
+        soup_message_body_append(msg->request_body, SOUP_MEMORY_STATIC, WAV_HEADER, sizeof(WAV_HEADER));
     }
-    soup_message_headers_append(msg->request_headers, "Authorization", auth.toUtf8().data());
-    int httpStatusCode = soup_session_send_message(mSession, msg);
-    if (SOUP_STATUS_IS_CLIENT_ERROR(httpStatusCode) || SOUP_STATUS_IS_SERVER_ERROR(httpStatusCode)) {
-        throw Exception(HTTPError);
-    } else if (SOUP_STATUS_IS_TRANSPORT_ERROR(httpStatusCode)) {
-        throw Exception(IOError);
+    return msg;
+}
+
+Result<Speech::RecognitionResponse> Speech::recognitionResult(SoupMessage *msg, guint httpStatusCode, RecognitionLanguage language, const QElapsedTimer &timer, const QString &cacheKey)
+{
+    Result<RecognitionResponse> result;
+
+    result.setResponse(msg, httpStatusCode, timer);
+    if (!result.ok()) {
+        g_object_unref(msg);
+        return result;
     }
 
-    g_object_get(msg, "response-body", &body, NULL);
-    return parseRecognitionResponse(QByteArray(body->data, body->length));
+    auto body = ResponseBuffer::take(msg);
+    result.value = parseRecognitionResponse(body.bytes());
+    result.value.language = language;
+    if (!cacheKey.isEmpty() && !result.value.recognitionStatus.isEmpty() && result.value.recognitionStatus != "Error") {
+        saveRecognitionCache(cacheKey, body.bytes());
+    }
+
+    return result;
 }
 
 Speech::RecognitionResponse Speech::parseRecognitionResponse(const QByteArray &data)
@@ -244,6 +573,11 @@ bool Speech::hasSynthesizeCache(const QString &text, const Voice::Font &font) co
     return file.exists();
 }
 
+void Speech::removeSynthesizeCache(const QString &text, const Voice::Font &font)
+{
+    QFile::remove(cachePath(text, font));
+}
+
 QByteArray Speech::loadSynthesizeCache(const QString &text, const Voice::Font &font)
 {
     QFile file(cachePath(text, font));
@@ -260,7 +594,7 @@ bool Speech::saveSynthesizeCache(const QByteArray &data, const QString &text, co
 
     auto path = cachePath(text, font);
     auto pathDup = strdup(path.toUtf8().data());
-    QFile file(path);
+    QSaveFile file(path);
     QDir dir(QString(dirname(pathDup)));
 
     free(pathDup);
@@ -268,11 +602,191 @@ bool Speech::saveSynthesizeCache(const QByteArray &data, const QString &text, co
         dir.mkpath(dir.path());
     }
 
+    // The file only appears once complete, so hasSynthesizeCache never
+    // sees a partial one
     if (!file.open(QIODevice::WriteOnly)) {
         return false;
     }
+    if (file.write(data) < 0) {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
+
+bool Speech::findRecognitionCache(const QString &key, RecognitionLanguage language, RecognitionResponse *res)
+{
+    QByteArray data;
+
+    mRecognitionCacheMutex.lock();
+    auto cached = mRecognitionMemoryCache.object(key);
+    if (cached) {
+        data = *cached;
+    }
+    mRecognitionCacheMutex.unlock();
+
+    if (data.isEmpty()) {
+        QFile file(recognitionCachePath(key));
+        if (!file.open(QIODevice::ReadOnly)) {
+            return false;
+        }
+
+        data = file.readAll();
+        QMutexLocker locker(&mRecognitionCacheMutex);
+        mRecognitionMemoryCache.insert(key, new QByteArray(data.constData(), data.size()));
+    }
+
+    *res = parseRecognitionResponse(data);
+    res->language = language;
+    return !res->recognitionStatus.isEmpty();
+}
+
+void Speech::saveRecognitionCache(const QString &key, const QByteArray &data)
+{
+    mRecognitionCacheMutex.lock();
+    mRecognitionMemoryCache.insert(key, new QByteArray(data));
+    mRecognitionCacheMutex.unlock();
+
+    auto path = recognitionCachePath(key);
+    QDir dir(QFileInfo(path).path());
+    QSaveFile file(path);
+
+    if (!dir.exists()) {
+        dir.mkpath(dir.path());
+    }
+
+    // Readers see either the previous file or the complete new one
+    if (file.open(QIODevice::WriteOnly)) {
+        file.write(data);
+        file.commit();
+    }
+}
+
+QString Speech::recognitionCachePath(const QString &key)
+{
+    return "/var/cache/bing/recognition/" + key.left(2) + "/" + key;
+}
+
+QString Speech::recognitionCacheKey(const QByteArray &data, RecognitionLanguage language, RecognitionMode mode) const
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    auto endpointId = this->endpointId();
+
+    // The key covers the audio as it is sent, including the WAV header for custom endpoints
+    if (!endpointId.isEmpty()) {
+        hash.addData(reinterpret_cast<const char *>(WAV_HEADER), sizeof(WAV_HEADER));
+    }
+    hash.addData(data);
+    hash.addData(recognitionLanguageString(language).toUtf8());
+    hash.addData(QByteArray::number(mode));
+    hash.addData(endpointId.toUtf8());
+
+    return hash.result().toHex();
+}
+
+QString Speech::endpointId() const
+{
+    QReadLocker locker(&mLock);
+    return mEndpointId;
+}
+
+QString Speech::recognizerIssueUrl() const
+{
+    return endpointId().isEmpty() ? FETCH_TOKEN_URI : CUSTOM_FETCH_TOKEN_URI;
+}
+
+Router::Service Speech::recognitionService() const
+{
+    return endpointId().isEmpty() ? Router::RecognitionService : Router::CustomRecognitionService;
+}
+
+// Requests in flight hold on to the token managers they use, so replaced
+// ones are only deleted once those requests are done, and on the thread
+// their timer lives in
+void Speech::setSubscriptionKeys(Credentials &credentials, const QStringList &keys, const QString &issueUrl)
+{
+    QWriteLocker locker(&mLock);
+    auto previous = credentials.tokens;
+
+    credentials.tokens.clear();
+    for (auto &key : keys) {
+        if (credentials.tokens.contains(key)) {
+            continue;
+        }
+
+        auto tokens = previous.take(key);
+        if (!tokens) {
+            tokens = QSharedPointer<TokenManager>(new TokenManager(), &QObject::deleteLater);
+        }
+        tokens->setIssueUrl(issueUrl);
+        tokens->setSubscriptionKey(key);
+
+        // Tokens saved by a previous process are used as is, so the first
+        // request doesn't wait for a fetch
+        if (!mTokenStore.isEmpty()) {
+            tokens->setStorePath(tokenStorePath(issueUrl, key));
+        }
+        if (!tokens->restore()) {
+            tokens->refresh();
+        }
+        credentials.tokens.insert(key, tokens);
+    }
+    credentials.keys.setKeys(keys);
+}
+
+// Applies the timeout set with setTimeout() when options has no deadline
+RequestOptions Speech::requestOptions(const RequestOptions &options) const
+{
+    auto result = options;
+
+    if (result.deadline == 0 && mTimeout > 0) {
+        result.deadline = QDateTime::currentMSecsSinceEpoch() + mTimeout * 1000LL;
+    }
+    return result;
+}
+
+// Sends msg with a token for the next key in the pool, moving on to
+// another key when the session retries, and refreshing the token and
+// retrying once if the service rejects it
+guint Speech::sendAuthorized(SoupMessage *msg, Credentials &credentials, Router::Service service, const RequestOptions &callerOptions, bool canRetry)
+{
+    auto options = requestOptions(callerOptions);
+    QString key;
+    QSharedPointer<TokenManager> tokens;
+    auto prepare = [&](SoupMessage *msg, int attempt) {
+        if (attempt > 0) {
+            credentials.keys.report(key, msg);
+        }
+        key = credentials.keys.acquire();
+        RateLimiter::instance()->acquire(service, key, options);
+        mLock.lockForRead();
+        tokens = credentials.tokens.value(key);
+        mLock.unlock();
+        soup_message_headers_replace(msg->request_headers, "Authorization", bearer(tokens.data(), options).data());
+    };
+
+    auto httpStatusCode = Session::instance()->send(msg, Router::instance()->route(service, prepare), canRetry, options);
+
+    if (httpStatusCode == SOUP_STATUS_UNAUTHORIZED && tokens && canRetry) {
+        auto rejected = QString(soup_message_headers_get_one(msg->request_headers, "Authorization")).mid(strlen("Bearer "));
+        tokens->invalidate(rejected);
+        soup_message_headers_replace(msg->request_headers, "Authorization", bearer(tokens.data(), options).data());
+        RateLimiter::instance()->acquire(service, key, options);
+        httpStatusCode = Session::instance()->send(msg, Session::Prepare(), true, options);
+    }
+    credentials.keys.report(key, msg);
+
+    return httpStatusCode;
+}
+
+// One file per issuer and key, named so the key itself never hits the disk
+// Called with mLock held
+QString Speech::tokenStorePath(const QString &url, const QString &subscriptionKey) const
+{
+    auto name = QCryptographicHash::hash((url + subscriptionKey).toUtf8(), QCryptographicHash::Sha1).toHex();
 
-    return file.write(data) >= 0;
+    return mTokenStore + "/" + name;
 }
 
 QString Speech::cachePath(const QString &text, const Voice::Font &font)
@@ -301,6 +815,16 @@ bool Speech::RecognitionResponse::isSilent() const
     return recognitionStatus == "InitialSilenceTimeout";
 }
 
+double Speech::RecognitionResponse::confidence() const
+{
+    double best = 0;
+
+    for (auto i = 0; i < nbest.size(); i++) {
+        best = qMax(best, nbest[i].confidence);
+    }
+    return best;
+}
+
 void Speech::RecognitionResponse::print() const
 {
     fprintf(stdout, "RecognitionStatus: %s\n", recognitionStatus.toUtf8().data());
@@ -891,38 +1415,64 @@ namespace Voice {
     }
 }
 
-QByteArray Speech::synthesize(const QString &text, Voice::Font font)
+QByteArray Speech::synthesize(const QString &text, Voice::Font font, const RequestOptions &options)
 {
-    QByteArray result;
+    return trySynthesize(text, font, options).get();
+}
+
+Result<QByteArray> Speech::trySynthesize(const QString &text, Voice::Font font, const RequestOptions &options)
+{
+    auto result = trySynthesizeBuffer(text, font, options);
+    return result.withValue(result.value.toByteArray());
+}
+
+ResponseBuffer Speech::synthesizeBuffer(const QString &text, Voice::Font font, const RequestOptions &options)
+{
+    return trySynthesizeBuffer(text, font, options).get();
+}
+
+Result<ResponseBuffer> Speech::trySynthesizeBuffer(const QString &text, Voice::Font font, const RequestOptions &options)
+{
+    Result<ResponseBuffer> result;
+    QElapsedTimer timer;
 
     if (mCache && hasSynthesizeCache(text, font)) {
-        return loadSynthesizeCache(text, font);
+        return Result<ResponseBuffer>::cached(ResponseBuffer(loadSynthesizeCache(text, font)));
     }
 
     SoupMessage *msg;
-    SoupMessageBody *body;
-    QString auth = "Bearer " + mSynthesizerToken;
     QString format = "raw-16khz-16bit-mono-pcm";
     QString dataStr = "<speak version='1.0' xml:lang='en-US'><voice xml:lang='" + font.lang + "' xml:gender='" + font.gender + "' name='" + font.name + "'>" + text + "</voice></speak>";
     QByteArray data = dataStr.toUtf8();
 
-    // Do POST request
-    msg = soup_message_new("POST", SYNTHESIZE_URL.toUtf8().data());
+    // Build POST request
+    auto baseUrl = Router::instance()->select(Router::SynthesisService);
+    msg = soup_message_new("POST", (baseUrl + SYNTHESIZE_PATH).toUtf8().data());
     soup_message_set_request(msg, "application/ssml+xml", SOUP_MEMORY_COPY, data.data(), data.size());
-    soup_message_headers_append(msg->request_headers, "Authorization", auth.toUtf8().data());
     soup_message_headers_append(msg->request_headers, "X-Microsoft-OutputFormat", format.toUtf8().data());
     soup_message_headers_append(msg->request_headers, "User-Agent", "libbing");
 
-    int httpStatusCode = soup_session_send_message(mSession, msg);
-    if (httpStatusCode >= 400) {
-        throw Exception(HTTPError);
+    guint httpStatusCode;
+    timer.start();
+    if (mHedging) {
+        auto alternate = Router::instance()->select(Router::SynthesisService, QStringList() << baseUrl);
+        httpStatusCode = Session::instance()->hedge(msg, [this, &options](SoupMessage *msg) {
+            return sendAuthorized(msg, mSynthesizer, Router::SynthesisService, options);
+        }, alternate);
+    } else {
+        httpStatusCode = sendAuthorized(msg, mSynthesizer, Router::SynthesisService, options);
+    }
+    result.setResponse(msg, httpStatusCode, timer);
+    if (!result.ok()) {
+        g_object_unref(msg);
+        return result;
     }
 
-    g_object_get(msg, "response-body", &body, NULL);
-    result = QByteArray(body->data, body->length);
+    result.value = ResponseBuffer::take(msg);
     if (mCache) {
-        if (!saveSynthesizeCache(result, text, font)) {
-            throw Exception(IOError);
+        if (!saveSynthesizeCache(result.value.bytes(), text, font)) {
+            result.error = IOError;
+            result.reason = "Could not save to the synthesis cache";
         }
     }
 
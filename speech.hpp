@@ -5,11 +5,25 @@
 #include <QByteArray>
 #include <QString>
 #include <QList>
-
-class QTimer;
+#include <QCache>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <atomic>
+#include <functional>
+#include "keypool.hpp"
+#include "requestoptions.hpp"
+#include "responsebuffer.hpp"
+#include "result.hpp"
+#include "router.hpp"
 
 namespace Bing {
 
+class AudioRingBuffer;
+class TokenManager;
+
 namespace Voice {
     struct Font {
         QString lang;
@@ -237,11 +251,32 @@ namespace Voice {
     }
 }
 
+/**
+ * Client for the Bing Speech recognition and synthesis APIs.
+ *
+ * Every instance has a configuration of its own, e.g. one for a custom
+ * endpoint next to one for the default endpoint, and can be used from
+ * several threads at once.
+ */
 class Speech : public QObject {
     Q_OBJECT
 public:
+    Speech(int log = 0, QObject *parent = nullptr);
+    ~Speech();
+
+    /**
+     * Sets the logging level of the shared session
+     */
     static void init(int log);
+
+    /**
+     * Deletes the process-wide instance
+     */
     static void destroy();
+
+    /**
+     * Process-wide instance, created on first use
+     */
     static Speech *instance();
 
     /////////////////
@@ -297,8 +332,10 @@ public:
     struct RecognitionResponse {
         bool hasMatch() const;
         bool isSilent() const;
+        double confidence() const;
         void print() const;
 
+        RecognitionLanguage language;
         QString recognitionStatus;
         int     offset;
         int     duration;
@@ -311,36 +348,120 @@ public:
     ////////////////
 
     void authenticate(const QString &recognizerSubscriptionKey, const QString &synthesizerSubscriptionkey);
+    void authenticate(const QStringList &recognizerSubscriptionKeys, const QStringList &synthesizerSubscriptionKeys);
+    void setKeyStrategy(KeyPool::Strategy strategy, int requestsPerMinute = 0);
     void fetchToken();
     void setCache(bool cache);
+
+    /**
+     * Whether synthesize() answers text in font from the cache
+     */
+    bool hasSynthesizeCache(const QString &text, const Voice::Font &font) const;
+
+    /**
+     * Drops the cached audio of text in font
+     */
+    void removeSynthesizeCache(const QString &text, const Voice::Font &font);
+    void setRecognitionCache(bool cache);
+
+    /**
+     * Races a duplicate synthesis request against ones slower than usual,
+     * see Session::setHedging()
+     */
+    void setHedging(bool hedging);
     void setEndpointId(const QString &endpointId);
+    void setTokenStore(const QString &directory);
+
+    /**
+     * Deadline of every request of this client made without one of its
+     * own, in seconds from the call; 0 for none. Other clients sharing the
+     * session aren't affected, see Session::setTimeout() for those.
+     */
     void setTimeout(unsigned int secs);
 
-    RecognitionResponse recognize(const QByteArray &data, RecognitionLanguage language = EnglishUnitedStates, RecognitionMode mode = Interactive);
-    QByteArray synthesize(const QString &text, Voice::Font font = Voice::en_US::ZiraRUS);
+    /**
+     * Connects to the token, recognition and synthesis endpoints ahead of
+     * the first request
+     *
+     * \param connections Number of connections to open per host
+     * \param wait Whether to block until the connections are up
+     */
+    void prewarm(int connections = 1, bool wait = false);
+
+    RecognitionResponse recognize(const QByteArray &data, RecognitionLanguage language = EnglishUnitedStates, RecognitionMode mode = Interactive, const RequestOptions &options = RequestOptions());
+    RecognitionResponse recognize(const QByteArray &data, const QList<RecognitionLanguage> &languages, RecognitionMode mode = Interactive, double winningConfidence = 0, const RequestOptions &options = RequestOptions());
+    RecognitionResponse recognize(AudioRingBuffer &buffer, RecognitionLanguage language = EnglishUnitedStates, RecognitionMode mode = Interactive, const RequestOptions &options = RequestOptions());
+    RecognitionResponse recognizeFile(const QString &path, RecognitionLanguage language = EnglishUnitedStates, RecognitionMode mode = Interactive, const RequestOptions &options = RequestOptions());
+    RecognitionResponse recognizeFile(int fd, RecognitionLanguage language = EnglishUnitedStates, RecognitionMode mode = Interactive, const RequestOptions &options = RequestOptions());
+    QByteArray synthesize(const QString &text, Voice::Font font = Voice::en_US::ZiraRUS, const RequestOptions &options = RequestOptions());
+
+    //////////////////
+    // Non-throwing //
+    //////////////////
+
+    // Same as the methods above, but failures are returned with their
+    // status, timing and retry hint instead of being thrown
+    Result<RecognitionResponse> tryRecognize(const QByteArray &data, RecognitionLanguage language = EnglishUnitedStates, RecognitionMode mode = Interactive, const RequestOptions &options = RequestOptions());
+    Result<RecognitionResponse> tryRecognize(const QByteArray &data, const QList<RecognitionLanguage> &languages, RecognitionMode mode = Interactive, double winningConfidence = 0, const RequestOptions &options = RequestOptions());
+    Result<RecognitionResponse> tryRecognize(AudioRingBuffer &buffer, RecognitionLanguage language = EnglishUnitedStates, RecognitionMode mode = Interactive, const RequestOptions &options = RequestOptions());
+    Result<RecognitionResponse> tryRecognizeFile(const QString &path, RecognitionLanguage language = EnglishUnitedStates, RecognitionMode mode = Interactive, const RequestOptions &options = RequestOptions());
+    Result<RecognitionResponse> tryRecognizeFile(int fd, RecognitionLanguage language = EnglishUnitedStates, RecognitionMode mode = Interactive, const RequestOptions &options = RequestOptions());
+    Result<QByteArray> trySynthesize(const QString &text, Voice::Font font = Voice::en_US::ZiraRUS, const RequestOptions &options = RequestOptions());
+
+    /**
+     * Same as synthesize(), but the audio is handed over without being copied
+     */
+    ResponseBuffer synthesizeBuffer(const QString &text, Voice::Font font = Voice::en_US::ZiraRUS, const RequestOptions &options = RequestOptions());
+    Result<ResponseBuffer> trySynthesizeBuffer(const QString &text, Voice::Font font = Voice::en_US::ZiraRUS, const RequestOptions &options = RequestOptions());
 
 private:
     static Speech *mInstance;
-    static SoupSession *mSession;
-    static QTimer *mRenewTokenTimer;
-    static QString mRecognizerSubscriptionKey;
-    static QString mSynthesizerSubscriptionKey;
-    static QString mRecognizerToken;
-    static QString mSynthesizerToken;
-    static QString mConnectionId;
-    static QString mEndpointId;
-    static bool mCache;
+    static QMutex  mInstanceMutex;
+
+    struct Credentials {
+        KeyPool                                       keys;
+        QHash<QString, QSharedPointer<TokenManager> > tokens;
+    };
+
+    // mLock guards the strings and the token managers; keys and flags are thread-safe on their own
+    mutable QReadWriteLock mLock;
+    Credentials            mRecognizer;
+    Credentials            mSynthesizer;
+    QString                mEndpointId;
+    QString                mTokenStore;
+    std::atomic<bool>      mCache;
+    std::atomic<bool>      mRecognitionCache;
+    std::atomic<bool>      mHedging;
+    std::atomic<uint>      mTimeout;
+
+    // Keyed by content and configuration, so every instance shares it
+    static QCache<QString, QByteArray> mRecognitionMemoryCache;
+    static QMutex mRecognitionCacheMutex;
 
     static QString cachePath(const QString &text, const Voice::Font &font);
+    static QString recognitionCachePath(const QString &key);
     static QString recognitionLanguageString(RecognitionLanguage language);
 
+    QString endpointId() const;
+    QString recognizerIssueUrl() const;
+    QString tokenStorePath(const QString &url, const QString &subscriptionKey) const;
+    void setSubscriptionKeys(Credentials &credentials, const QStringList &keys, const QString &issueUrl);
+    Router::Service recognitionService() const;
+    RequestOptions requestOptions(const RequestOptions &options) const;
+    guint sendAuthorized(SoupMessage *msg, Credentials &credentials, Router::Service service, const RequestOptions &options, bool canRetry = true);
+    QString recognitionCacheKey(const QByteArray &data, RecognitionLanguage language, RecognitionMode mode) const;
+
+    // Returns the number of bytes read, 0 at the end of the audio or -1 with errno set
+    typedef std::function<int(char *data, int size)> ChunkReader;
+
+    SoupMessage *recognitionMessage(RecognitionLanguage language, RecognitionMode mode);
+    Result<RecognitionResponse> recognizeStream(const ChunkReader &reader, RecognitionLanguage language, RecognitionMode mode, const RequestOptions &options);
+    Result<RecognitionResponse> recognitionResult(SoupMessage *msg, guint httpStatusCode, RecognitionLanguage language, const QElapsedTimer &timer, const QString &cacheKey = QString());
     RecognitionResponse parseRecognitionResponse(const QByteArray &data);
-    bool hasSynthesizeCache(const QString &text, const Voice::Font &font) const;
     QByteArray loadSynthesizeCache(const QString &text, const Voice::Font &font);
     bool saveSynthesizeCache(const QByteArray &data, const QString &text, const Voice::Font &font);
-
-private slots:
-    void renewToken();
+    bool findRecognitionCache(const QString &key, RecognitionLanguage language, RecognitionResponse *res);
+    void saveRecognitionCache(const QString &key, const QByteArray &data);
 };
 
 }
\ No newline at end of file
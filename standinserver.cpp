@@ -0,0 +1,239 @@
+#include "standinserver.hpp"
+
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <random>
+
+namespace Bing {
+
+const int TOKEN_LIFETIME = 600; // Seconds the stand-in tokens are valid
+
+struct Paused {
+    SoupServer * server;
+    SoupMessage *msg;
+};
+
+// Unsigned JWT whose only claim is its expiry, enough for the token manager
+static QByteArray standInToken()
+{
+    QJsonObject header;
+    QJsonObject payload;
+
+    header.insert("alg", "none");
+    payload.insert("exp", static_cast<double>(QDateTime::currentMSecsSinceEpoch() / 1000 + TOKEN_LIFETIME));
+
+    auto options = QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals;
+    return QJsonDocument(header).toJson(QJsonDocument::Compact).toBase64(options) + "." +
+           QJsonDocument(payload).toJson(QJsonDocument::Compact).toBase64(options) + ".";
+}
+
+StandInServer::StandInServer() :
+    mHasStarted(false),
+    mContext(NULL),
+    mLoop(NULL),
+    mServer(NULL),
+    mPort(-1),
+    mLatency(0),
+    mFailureRate(0),
+    mFailureStatus(SOUP_STATUS_SERVICE_UNAVAILABLE),
+    mRequests(0)
+{
+    setResponse("/sts/", "text/plain", QByteArray());
+    setResponse("/speech/recognition/", "application/json",
+                "{\"RecognitionStatus\":\"Success\",\"Offset\":0,\"Duration\":10000000,"
+                "\"NBest\":[{\"Confidence\":0.9,\"Lexical\":\"stand in\",\"ITN\":\"stand in\","
+                "\"MaskedITN\":\"stand in\",\"Display\":\"Stand in.\"}]}");
+    setResponse("/synthesize", "audio/x-wav", QByteArray(3200, 0));
+    setResponse("/qnamaker/", "application/json", "{\"answers\":[{\"answer\":\"Stand in.\",\"questions\":[],\"score\":100}]}");
+    setResponse("/customvision/", "application/json", "{\"Predictions\":[]}");
+}
+
+StandInServer::~StandInServer()
+{
+    close();
+}
+
+int StandInServer::listen(int port)
+{
+    QMutexLocker locker(&mMutex);
+
+    if (mThread.joinable()) {
+        return mPort;
+    }
+
+    mHasStarted = false;
+    mThread = std::thread(&StandInServer::run, this, port);
+    while (!mHasStarted) {
+        mStarted.wait(&mMutex);
+    }
+    auto listening = mPort;
+    locker.unlock();
+
+    if (listening < 0) {
+        mThread.join();
+    }
+    return listening;
+}
+
+void StandInServer::close()
+{
+    mMutex.lock();
+    auto loop = mLoop;
+    mMutex.unlock();
+
+    if (loop) {
+        g_main_loop_quit(loop);
+    }
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+QString StandInServer::baseUrl() const
+{
+    QMutexLocker locker(&mMutex);
+    return QString("http://127.0.0.1:%1").arg(mPort);
+}
+
+void StandInServer::setLatency(int msecs)
+{
+    QMutexLocker locker(&mMutex);
+    mLatency = msecs;
+}
+
+void StandInServer::setFailureRate(double rate, guint status)
+{
+    QMutexLocker locker(&mMutex);
+    mFailureRate = rate;
+    mFailureStatus = status;
+}
+
+void StandInServer::setResponse(const QString &pathPrefix, const QByteArray &contentType, const QByteArray &body)
+{
+    QMutexLocker locker(&mMutex);
+
+    for (auto &response : mResponses) {
+        if (response.pathPrefix == pathPrefix) {
+            response.contentType = contentType;
+            response.body = body;
+            return;
+        }
+    }
+    mResponses.append({ pathPrefix, contentType, body });
+}
+
+qint64 StandInServer::requests() const
+{
+    QMutexLocker locker(&mMutex);
+    return mRequests;
+}
+
+// The server lives in a main context of its own, driven by this thread
+void StandInServer::run(int port)
+{
+    GError *error = NULL;
+    auto context = g_main_context_new();
+    g_main_context_push_thread_default(context);
+
+    auto server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "bing-standin", NULL);
+    soup_server_add_handler(server, NULL, handler, this, NULL);
+
+    mMutex.lock();
+    if (soup_server_listen_local(server, port, SOUP_SERVER_LISTEN_IPV4_ONLY, &error)) {
+        auto uris = soup_server_get_uris(server);
+        mPort = uris ? static_cast<SoupURI *>(uris->data)->port : port;
+        g_slist_free_full(uris, reinterpret_cast<GDestroyNotify>(soup_uri_free));
+        mContext = context;
+        mServer = server;
+        mLoop = g_main_loop_new(context, FALSE);
+    } else {
+        mPort = -1;
+        g_error_free(error);
+    }
+    auto loop = mLoop;
+    mHasStarted = true;
+    mStarted.wakeAll();
+    mMutex.unlock();
+
+    if (loop) {
+        g_main_loop_run(loop);
+    }
+
+    mMutex.lock();
+    mLoop = NULL;
+    mServer = NULL;
+    mContext = NULL;
+    mMutex.unlock();
+
+    if (loop) {
+        g_main_loop_unref(loop);
+    }
+    soup_server_disconnect(server);
+    g_object_unref(server);
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+}
+
+void StandInServer::handler(SoupServer *server, SoupMessage *msg, const char *path, GHashTable *, SoupClientContext *, gpointer data)
+{
+    static_cast<StandInServer *>(data)->handle(server, msg, path);
+}
+
+void StandInServer::handle(SoupServer *server, SoupMessage *msg, const char *path)
+{
+    static thread_local std::mt19937 generator(std::random_device{}());
+    std::uniform_real_distribution<double> chance(0, 1);
+
+    mMutex.lock();
+    mRequests++;
+    auto latency = mLatency;
+    auto failed = mFailureRate > 0 && chance(generator) < mFailureRate;
+    auto failureStatus = mFailureStatus;
+    mMutex.unlock();
+
+    auto canned = response(path);
+    if (failed) {
+        soup_message_set_status(msg, failureStatus);
+    } else if (canned.pathPrefix.isEmpty()) {
+        soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+    } else {
+        auto body = QString(path).startsWith("/sts/") ? standInToken() : canned.body;
+        soup_message_set_status(msg, SOUP_STATUS_OK);
+        soup_message_set_response(msg, canned.contentType.data(), SOUP_MEMORY_COPY, body.data(), body.size());
+    }
+
+    // Hold the response back without blocking the other requests
+    if (latency > 0) {
+        auto paused = new Paused { server, msg };
+        soup_server_pause_message(server, msg);
+        auto source = g_timeout_source_new(latency);
+        g_source_set_callback(source, resume, paused, NULL);
+        g_source_attach(source, g_main_context_get_thread_default());
+        g_source_unref(source);
+    }
+}
+
+gboolean StandInServer::resume(gpointer data)
+{
+    auto paused = static_cast<Paused *>(data);
+
+    soup_server_unpause_message(paused->server, paused->msg);
+    delete paused;
+    return G_SOURCE_REMOVE;
+}
+
+StandInServer::Response StandInServer::response(const QString &path) const
+{
+    QMutexLocker locker(&mMutex);
+    Response best;
+
+    for (auto &response : mResponses) {
+        if (path.startsWith(response.pathPrefix) && response.pathPrefix.size() > best.pathPrefix.size()) {
+            best = response;
+        }
+    }
+    return best;
+}
+
+}
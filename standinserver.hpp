@@ -0,0 +1,93 @@
+#pragma once
+
+#include <libsoup/soup.h>
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+#include <thread>
+
+namespace Bing {
+
+/**
+ * Local HTTP server that stands in for the Bing endpoints, for testing
+ * the routing, retry and failure handling without the network.
+ *
+ * It answers the token, recognition, synthesis, QnA and prediction paths
+ * with canned responses, after a configurable latency and with a
+ * configurable share of failures. Point the Router at the base URLs of a
+ * few of them to simulate regions.
+ */
+class StandInServer {
+public:
+    StandInServer();
+    ~StandInServer();
+
+    /**
+     * Starts serving on 127.0.0.1
+     *
+     * \param port Port to listen on, 0 for any free one
+     * \return Port listened on, -1 on failure
+     */
+    int listen(int port = 0);
+    void close();
+
+    /**
+     * Base URL of the server, e.g. "http://127.0.0.1:8080"
+     */
+    QString baseUrl() const;
+
+    /**
+     * Milliseconds every response is held back
+     */
+    void setLatency(int msecs);
+
+    /**
+     * Share of requests answered with status instead of the canned response
+     */
+    void setFailureRate(double rate, guint status = SOUP_STATUS_SERVICE_UNAVAILABLE);
+
+    /**
+     * Answers requests whose path starts with pathPrefix with body
+     */
+    void setResponse(const QString &pathPrefix, const QByteArray &contentType, const QByteArray &body);
+
+    /**
+     * Requests answered so far
+     */
+    qint64 requests() const;
+
+private:
+    StandInServer(const StandInServer &);
+    StandInServer &operator=(const StandInServer &);
+
+    struct Response {
+        QString    pathPrefix;
+        QByteArray contentType;
+        QByteArray body;
+    };
+
+    mutable QMutex  mMutex;
+    QWaitCondition  mStarted;
+    bool            mHasStarted;
+    GMainContext *  mContext;
+    GMainLoop *     mLoop;
+    SoupServer *    mServer;
+    std::thread     mThread;
+    int             mPort;
+    int             mLatency;
+    double          mFailureRate;
+    guint           mFailureStatus;
+    QList<Response> mResponses;
+    qint64          mRequests;
+
+    void run(int port);
+    void handle(SoupServer *server, SoupMessage *msg, const char *path);
+    Response response(const QString &path) const;
+
+    static void handler(SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query, SoupClientContext *client, gpointer data);
+    static gboolean resume(gpointer data);
+};
+
+}
@@ -0,0 +1,242 @@
+#include "tokenmanager.hpp"
+#include "session.hpp"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+#include <QtConcurrent>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace Bing {
+
+const int DEFAULT_TOKEN_LIFETIME = 600; // Seconds a token is assumed valid when it carries no expiry
+const int REFRESH_MARGIN         = 60;  // Seconds before expiry to fetch a new token
+const int RETRY_INTERVAL         = 10;  // Seconds before retrying a failed fetch
+const int CANCEL_POLL_INTERVAL   = 50;  // Milliseconds between checks for cancellation while waiting
+
+// Access tokens are JWTs, so the expiry is the "exp" claim of the payload
+static QDateTime tokenExpiry(const QByteArray &token)
+{
+    auto parts = token.split('.');
+
+    if (parts.size() == 3) {
+        auto payload = QByteArray::fromBase64(parts[1], QByteArray::Base64UrlEncoding);
+        auto exp = QJsonDocument::fromJson(payload).object()["exp"].toDouble();
+        if (exp > 0) {
+            return QDateTime::fromMSecsSinceEpoch(static_cast<qint64>(exp) * 1000, Qt::UTC);
+        }
+    }
+
+    return QDateTime::currentDateTimeUtc().addSecs(DEFAULT_TOKEN_LIFETIME);
+}
+
+TokenManager::TokenManager(QObject *parent) :
+    QObject(parent),
+    mTimer(new QTimer(this)),
+    mFetching(false)
+{
+    mTimer->setSingleShot(true);
+    connect(mTimer, &QTimer::timeout, this, &TokenManager::refresh);
+}
+
+TokenManager::~TokenManager()
+{
+    mFetch.waitForFinished();
+}
+
+void TokenManager::setIssueUrl(const QString &url)
+{
+    QMutexLocker locker(&mMutex);
+    mIssueUrl = url;
+}
+
+void TokenManager::setSubscriptionKey(const QString &subscriptionKey)
+{
+    QMutexLocker locker(&mMutex);
+    mSubscriptionKey = subscriptionKey;
+}
+
+void TokenManager::setStorePath(const QString &path)
+{
+    QMutexLocker locker(&mMutex);
+    mStorePath = path;
+}
+
+bool TokenManager::restore()
+{
+    QMutexLocker locker(&mMutex);
+    QFile file(mStorePath);
+
+    if (mStorePath.isEmpty() || !file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    auto obj = QJsonDocument::fromJson(file.readAll()).object();
+    auto token = obj["token"].toString();
+    auto expiry = QDateTime::fromMSecsSinceEpoch(static_cast<qint64>(obj["expiry"].toDouble()), Qt::UTC);
+
+    // Only reuse a token that won't need renewing right away
+    if (token.isEmpty() || QDateTime::currentDateTimeUtc() >= expiry.addSecs(-REFRESH_MARGIN)) {
+        return false;
+    }
+
+    mToken = token;
+    mExpiry = expiry;
+    locker.unlock();
+    schedule();
+
+    return true;
+}
+
+QString TokenManager::token(const RequestOptions &options)
+{
+    QMutexLocker locker(&mMutex);
+    auto now = QDateTime::currentDateTimeUtc();
+
+    // A valid token is always returned right away, renewing it in the background when it's close to expiry
+    if (!mToken.isEmpty() && now < mExpiry) {
+        if (now >= mExpiry.addSecs(-REFRESH_MARGIN)) {
+            startFetch();
+        }
+        return mToken;
+    }
+
+    // Only wait when there is no usable token at all
+    startFetch();
+    while (mFetching && !options.token.isCancelled()) {
+        qint64 wait = CANCEL_POLL_INTERVAL;
+        if (options.deadline > 0) {
+            wait = qMin(wait, options.deadline - QDateTime::currentMSecsSinceEpoch());
+            if (wait <= 0) {
+                break;
+            }
+        }
+        mFetched.wait(&mMutex, static_cast<unsigned long>(wait));
+    }
+    return mToken;
+}
+
+QDateTime TokenManager::expiry() const
+{
+    QMutexLocker locker(&mMutex);
+    return mExpiry;
+}
+
+void TokenManager::refresh()
+{
+    QMutexLocker locker(&mMutex);
+    startFetch();
+}
+
+void TokenManager::invalidate(const QString &token)
+{
+    QMutexLocker locker(&mMutex);
+
+    if (token == mToken) {
+        mExpiry = QDateTime::currentDateTimeUtc();
+        startFetch();
+    }
+}
+
+void TokenManager::startFetch()
+{
+    if (mFetching) {
+        return;
+    }
+
+    mFetching = true;
+    mFetch = QtConcurrent::run([this]() {
+        fetch();
+    });
+}
+
+void TokenManager::fetch()
+{
+    SoupMessage *msg;
+    QByteArray token;
+
+    mMutex.lock();
+    auto url = mIssueUrl;
+    auto subscriptionKey = mSubscriptionKey;
+    mMutex.unlock();
+
+    msg = soup_message_new("POST", url.toUtf8().data());
+    soup_message_headers_append(msg->request_headers, "Content-Length", "0");
+    soup_message_headers_append(msg->request_headers, "Ocp-Apim-Subscription-Key", subscriptionKey.toUtf8().data());
+    auto httpStatusCode = Session::instance()->send(msg);
+    if (SOUP_STATUS_IS_SUCCESSFUL(httpStatusCode)) {
+        token = QByteArray(msg->response_body->data, msg->response_body->length);
+    }
+    g_object_unref(msg);
+
+    // Swap the new token in, keeping the old one if the fetch failed
+    mMutex.lock();
+    auto storePath = mStorePath;
+    if (!token.isEmpty()) {
+        mToken = token;
+        mExpiry = tokenExpiry(token);
+    }
+    auto expiry = mExpiry;
+    mFetching = false;
+    mFetched.wakeAll();
+    mMutex.unlock();
+
+    if (!token.isEmpty() && !storePath.isEmpty()) {
+        save(storePath, token, expiry);
+    }
+
+    QMetaObject::invokeMethod(this, "schedule", Qt::QueuedConnection);
+}
+
+// Tokens are credentials, so the store is only ever readable by the owner
+void TokenManager::save(const QString &path, const QString &token, const QDateTime &expiry)
+{
+    QJsonObject obj;
+    QDir dir(QFileInfo(path).path());
+    auto tmpPath = (path + ".XXXXXX").toUtf8();
+
+    if (!dir.exists()) {
+        dir.mkpath(dir.path());
+        chmod(dir.path().toUtf8().data(), S_IRWXU);
+    }
+
+    obj.insert("token", token);
+    obj.insert("expiry", static_cast<double>(expiry.toMSecsSinceEpoch()));
+    auto data = QJsonDocument(obj).toJson(QJsonDocument::Compact);
+
+    // Every writer gets its own temporary file, so workers starting together
+    // never write into each other's
+    int fd = mkostemp(tmpPath.data(), O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    fchmod(fd, S_IRUSR | S_IWUSR);
+    bool written = write(fd, data.data(), data.size()) == data.size();
+    close(fd);
+
+    if (!written || rename(tmpPath.data(), path.toUtf8().data()) < 0) {
+        unlink(tmpPath.data());
+    }
+}
+
+void TokenManager::schedule()
+{
+    QMutexLocker locker(&mMutex);
+    auto now = QDateTime::currentDateTimeUtc();
+    qint64 msecs = RETRY_INTERVAL * 1000;
+
+    if (!mToken.isEmpty() && now < mExpiry) {
+        msecs = qMax(msecs, now.msecsTo(mExpiry.addSecs(-REFRESH_MARGIN)));
+    }
+    mTimer->start(static_cast<int>(msecs));
+}
+
+}
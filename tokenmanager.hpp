@@ -0,0 +1,55 @@
+#pragma once
+
+#include <libsoup/soup.h>
+#include <QObject>
+#include <QDateTime>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QFuture>
+#include "requestoptions.hpp"
+
+class QTimer;
+
+namespace Bing {
+
+class TokenManager : public QObject {
+    Q_OBJECT
+public:
+    TokenManager(QObject *parent = nullptr);
+    ~TokenManager();
+
+    void setIssueUrl(const QString &url);
+    void setSubscriptionKey(const QString &subscriptionKey);
+    void setStorePath(const QString &path);
+    bool restore();
+
+    /**
+     * Current token, waiting for the first one to be fetched for no
+     * longer than the deadline of options and not once they're cancelled
+     */
+    QString token(const RequestOptions &options = RequestOptions());
+    QDateTime expiry() const;
+    void refresh();
+    void invalidate(const QString &token);
+
+private:
+    QTimer *               mTimer;
+    mutable QMutex         mMutex;
+    QWaitCondition         mFetched;
+    QFuture<void>          mFetch;
+    bool                   mFetching;
+    QString                mIssueUrl;
+    QString                mSubscriptionKey;
+    QString                mStorePath;
+    QString                mToken;
+    QDateTime              mExpiry;
+
+    void startFetch();
+    void fetch();
+    void save(const QString &path, const QString &token, const QDateTime &expiry);
+
+private slots:
+    void schedule();
+};
+
+}